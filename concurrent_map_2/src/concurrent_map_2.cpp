@@ -2,65 +2,557 @@
 #include "../../test_runner.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
+#include <numeric>
 #include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 using namespace std;
 
+const size_t CACHE_LINE_SIZE = 64;
+
+size_t RoundUpToPowerOfTwo(size_t value) {
+  size_t result = 1;
+  while (result < value) {
+    result *= 2;
+  }
+  return result;
+}
+
 template <typename K, typename V, typename Hash = std::hash<K>>
 class ConcurrentMap {
  public:
   using MapType = unordered_map<K, V, Hash>;
 
+  // The lock is taken before the bucket is touched and held while the
+  // access lives: exclusive for writers, shared for readers.
   struct WriteAccess {
+    WriteAccess(shared_mutex& mtx, MapType& map, const K& key)
+        : lg(mtx), ref_to_value(map[key]) {}
+
+    lock_guard<shared_mutex> lg;
     V& ref_to_value;
-    lock_guard<mutex> lg;
   };
 
   struct ReadAccess {
+    ReadAccess(shared_mutex& mtx, const MapType& map, const K& key)
+        : lg(mtx), ref_to_value(map.at(key)) {}
+
+    shared_lock<shared_mutex> lg;
     const V& ref_to_value;
-    lock_guard<mutex> lg;
   };
 
+  // The bucket count is rounded up to a power of two.
   explicit ConcurrentMap(size_t bucket_count)
-      : bkts_count(bucket_count), mtxs(bkts_count), mapVec(bkts_count) {}
+      : bkts_mask(RoundUpToPowerOfTwo(bucket_count) - 1),
+        buckets(bkts_mask + 1) {}
 
   WriteAccess operator[](const K& key) {
-    size_t hash_id = hasher(key);
-    return {mapVec[hash_id % bkts_count][key],
-            lock_guard<mutex>(mtxs[hash_id % bkts_count])};
+    Bucket& bucket = GetBucket(key);
+    return {bucket.mtx, bucket.map, key};
   }
   ReadAccess At(const K& key) const {
-    size_t hash_id = hasher(key);
-    return {mapVec.at(hash_id % bkts_count).at(key),
-            lock_guard<mutex>(mtxs[hash_id % bkts_count])};
+    const Bucket& bucket = GetBucket(key);
+    return {bucket.mtx, bucket.map, key};
   }
 
   bool Has(const K& key) const {
-    size_t hash_id = hasher(key);
-    return mapVec.at(hash_id % bkts_count).find(key) !=
-           mapVec.at(hash_id % bkts_count).end();
+    const Bucket& bucket = GetBucket(key);
+    shared_lock lg(bucket.mtx);
+    return bucket.map.count(key) > 0;
+  }
+
+  // Calls update(value) for every (key, update) pair of the range; updates of
+  // one key are applied in the order they come. The pairs are grouped by
+  // bucket first, so a bucket is locked once per batch instead of once per
+  // key.
+  template <typename Iterator>
+  void UpdateBatch(Iterator first, Iterator last) {
+    // A counting sort by bucket, which keeps the order within a bucket
+    vector<size_t> bucket_ids;
+    vector<size_t> starts(buckets.size() + 1);
+    for (Iterator it = first; it != last; ++it) {
+      bucket_ids.push_back(hasher(it->first) & bkts_mask);
+      ++starts[bucket_ids.back() + 1];
+    }
+    partial_sum(starts.begin(), starts.end(), starts.begin());
+
+    vector<Iterator> order(bucket_ids.size());
+    vector<size_t> ends(starts.begin(), starts.end() - 1);
+    size_t index = 0;
+    for (Iterator it = first; it != last; ++it) {
+      order[ends[bucket_ids[index++]]++] = it;
+    }
+
+    for (size_t bucket_id = 0; bucket_id < buckets.size(); ++bucket_id) {
+      if (starts[bucket_id] == ends[bucket_id]) {
+        continue;
+      }
+      // The next lock is on its way while this bucket is busy
+      if (ends[bucket_id] < order.size()) {
+        const auto& [next_key, next_update] = *order[ends[bucket_id]];
+        __builtin_prefetch(&buckets[hasher(next_key) & bkts_mask]);
+      }
+
+      Bucket& bucket = buckets[bucket_id];
+      lock_guard lg(bucket.mtx);
+      for (size_t i = starts[bucket_id]; i < ends[bucket_id]; ++i) {
+        auto& [key, update] = *order[i];
+        update(bucket.map[key]);
+      }
+    }
+  }
+
+  // Every bucket is copied under its own lock, so each one is seen as it was
+  // at some moment; writers to other buckets are not held up.
+  MapType BuildOrdinaryMap() const {
+    MapType result;
+    for (const Bucket& bucket : buckets) {
+      shared_lock lg(bucket.mtx);
+      result.insert(bucket.map.begin(), bucket.map.end());
+    }
+    return result;
+  }
+
+ private:
+  // Every bucket starts a cache line and is padded to whole lines, so no two
+  // buckets share one and threads busy with different buckets do not
+  // contend. The lock and the map themselves take about two lines (112 bytes
+  // with libstdc++), which a thread holding the bucket touches anyway.
+  struct alignas(CACHE_LINE_SIZE) Bucket {
+    mutable shared_mutex mtx;
+    MapType map;
+  };
+  static_assert(sizeof(Bucket) % CACHE_LINE_SIZE == 0,
+                "Buckets must not share cache lines");
+
+  Hash hasher;
+  const size_t bkts_mask;
+  vector<Bucket> buckets;
+
+  Bucket& GetBucket(const K& key) { return buckets[hasher(key) & bkts_mask]; }
+  const Bucket& GetBucket(const K& key) const {
+    return buckets[hasher(key) & bkts_mask];
+  }
+};
+
+// Open-addressing map for trivially copyable keys and values without locks:
+// values are atomics updated in place, e.g. with fetch_add, and new keys are
+// published by a compare-and-swap on their slot.
+//
+// Slots only index entries that hold the key and the value and never move.
+// A table that gets half full is replaced by one twice as big, and every
+// thread that inserts while the replacement is under way helps to copy the
+// slots over in chunks. Since a filled slot never changes, lookups, and so
+// updates of existing keys, take the key from whichever table still has it
+// and never wait. Inserts and BuildOrdinaryMap do wait, yielding, until the
+// copy is finished, so they are not lock-free. Replaced tables are kept until
+// the map is destroyed, which costs at most as much memory again.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class LockFreeMap {
+  static_assert(is_trivially_copyable_v<K> && is_trivially_copyable_v<V>,
+                "LockFreeMap keeps keys and values in atomic slots");
+
+ public:
+  using MapType = unordered_map<K, V, Hash>;
+
+  struct WriteAccess {
+    atomic<V>& ref_to_value;
+  };
+
+  struct ReadAccess {
+    const atomic<V>& ref_to_value;
+  };
+
+  explicit LockFreeMap(size_t expected_size = 0)
+      : first_table(new Table(RoundUpToPowerOfTwo(max<size_t>(
+            expected_size * 2, MIN_CAPACITY)))),
+        current(first_table) {}
+
+  LockFreeMap(const LockFreeMap&) = delete;
+  LockFreeMap& operator=(const LockFreeMap&) = delete;
+
+  ~LockFreeMap() {
+    for (Table* table = first_table; table;) {
+      Table* next = table->next;
+      delete table;
+      table = next;
+    }
+    for (auto& chunk : chunks) {
+      delete[] chunk.load();
+    }
   }
 
+  WriteAccess operator[](const K& key) {
+    return {GetEntry(FindOrInsert(key)).value};
+  }
+  ReadAccess At(const K& key) const {
+    const uint32_t entry = Find(key);
+    if (entry == NO_ENTRY) {
+      throw out_of_range("No such key in LockFreeMap");
+    }
+    return {GetEntry(entry).value};
+  }
+
+  bool Has(const K& key) const { return Find(key) != NO_ENTRY; }
+
+  // Values are read one by one, so concurrent updates may be seen partly.
   MapType BuildOrdinaryMap() const {
+    const Table& table = Settle(current.load(memory_order_acquire));
     MapType result;
-    for (const auto& mv : mapVec) {
-      result.insert(mv.begin(), mv.end());
+    result.reserve(table.size);
+    for (size_t i = 0; i <= table.mask; ++i) {
+      const uint64_t slot = table.slots[i].load(memory_order_acquire);
+      if (slot != EMPTY && slot != MOVED) {
+        const Entry& entry = GetEntry(ToEntry(slot));
+        result[entry.key] = entry.value.load(memory_order_relaxed);
+      }
     }
     return result;
   }
 
  private:
+  // A slot holds the upper half of the key's hash and the entry index + 1
+  static constexpr uint64_t EMPTY = 0;
+  static constexpr uint64_t MOVED = UINT64_MAX;
+  static constexpr uint32_t NO_ENTRY = UINT32_MAX;
+  static constexpr size_t MIN_CAPACITY = 16;
+  static constexpr size_t MIGRATION_CHUNK = 1024;
+  // Entry chunk c holds 2^(FIRST_CHUNK_BITS + c) entries
+  static constexpr int FIRST_CHUNK_BITS = 10;
+  static constexpr int CHUNK_COUNT = 33 - FIRST_CHUNK_BITS;
+
+  struct Entry {
+    K key;
+    atomic<V> value;
+  };
+
+  struct Table {
+    explicit Table(size_t capacity)
+        : mask(capacity - 1), slots(new atomic<uint64_t>[capacity]()) {}
+
+    const size_t mask;
+    unique_ptr<atomic<uint64_t>[]> slots;
+    alignas(CACHE_LINE_SIZE) atomic<size_t> size = 0;
+    alignas(CACHE_LINE_SIZE) atomic<Table*> next = nullptr;
+    atomic<size_t> migration_cursor = 0;
+    atomic<size_t> migrated = 0;
+  };
+
   Hash hasher;
-  const size_t bkts_count;
-  vector<MapType> mapVec;
-  mutable vector<std::mutex> mtxs;
+  Table* const first_table;
+  mutable atomic<Table*> current;
+  alignas(CACHE_LINE_SIZE) atomic<uint64_t> entry_count = 0;
+  atomic<Entry*> chunks[CHUNK_COUNT] = {};
+
+  static uint64_t Mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 33);
+  }
+
+  static uint64_t ToSlot(uint64_t hash, uint32_t entry) {
+    return (hash >> 32 << 32) | (uint64_t(entry) + 1);
+  }
+
+  static uint32_t ToEntry(uint64_t slot) {
+    return static_cast<uint32_t>(slot) - 1;
+  }
+
+  static bool HasTag(uint64_t slot, uint64_t hash) {
+    return slot >> 32 == hash >> 32;
+  }
+
+  // Entry e is at offset p - 2^b of chunk b - FIRST_CHUNK_BITS, where
+  // p = e + 2^FIRST_CHUNK_BITS and b is the highest bit of p
+  static uint64_t ToPosition(uint64_t entry) {
+    return entry + (uint64_t(1) << FIRST_CHUNK_BITS);
+  }
+
+  static int HighestBit(uint64_t position) {
+    return 63 - __builtin_clzll(position);
+  }
+
+  Entry& GetEntry(uint32_t entry) const {
+    const uint64_t position = ToPosition(entry);
+    const int bit = HighestBit(position);
+    Entry* chunk = chunks[bit - FIRST_CHUNK_BITS].load(memory_order_acquire);
+    return chunk[position - (uint64_t(1) << bit)];
+  }
+
+  uint32_t NewEntry(const K& key) {
+    const uint64_t entry = entry_count.fetch_add(1, memory_order_relaxed);
+    if (entry >= NO_ENTRY - 1) {
+      throw length_error("Too many keys in LockFreeMap");
+    }
+    const int bit = HighestBit(ToPosition(entry));
+    atomic<Entry*>& chunk = chunks[bit - FIRST_CHUNK_BITS];
+    if (!chunk.load(memory_order_acquire)) {
+      Entry* fresh = new Entry[uint64_t(1) << bit];
+      Entry* expected = nullptr;
+      if (!chunk.compare_exchange_strong(expected, fresh)) {
+        delete[] fresh;
+      }
+    }
+
+    Entry& result = GetEntry(entry);
+    result.key = key;
+    result.value.store(V{}, memory_order_relaxed);
+    return entry;
+  }
+
+  // Returns the newest table, finishing the migrations on the way
+  Table& Settle(Table* table) const {
+    while (Table* next = table->next.load(memory_order_acquire)) {
+      HelpMigrate(*table, *next);
+      table = next;
+    }
+    return *table;
+  }
+
+  void HelpMigrate(Table& from, Table& to) const {
+    const size_t capacity = from.mask + 1;
+    for (size_t first = from.migration_cursor.fetch_add(MIGRATION_CHUNK);
+         first < capacity;
+         first = from.migration_cursor.fetch_add(MIGRATION_CHUNK)) {
+      const size_t last = min(capacity, first + MIGRATION_CHUNK);
+      size_t copied = 0;
+      for (size_t i = first; i < last; ++i) {
+        // An empty slot is closed for good, a filled one never changes
+        uint64_t slot = from.slots[i].load(memory_order_acquire);
+        while (slot == EMPTY &&
+               !from.slots[i].compare_exchange_weak(slot, MOVED)) {
+        }
+        if (slot != EMPTY && slot != MOVED) {
+          Transfer(to, slot);
+          ++copied;
+        }
+      }
+      to.size.fetch_add(copied, memory_order_relaxed);
+      from.migrated.fetch_add(last - first, memory_order_release);
+    }
+
+    while (from.migrated.load(memory_order_acquire) < capacity) {
+      this_thread::yield();
+    }
+    Table* expected = &from;
+    current.compare_exchange_strong(expected, &to);
+  }
+
+  void Transfer(Table& to, uint64_t slot) const {
+    const uint64_t hash = Mix(hasher(GetEntry(ToEntry(slot)).key));
+    for (size_t i = hash & to.mask;; i = (i + 1) & to.mask) {
+      uint64_t expected = EMPTY;
+      if (to.slots[i].compare_exchange_strong(expected, slot)) {
+        return;
+      }
+    }
+  }
+
+  void StartResize(Table& table) {
+    if (table.next.load(memory_order_acquire)) {
+      return;
+    }
+    Table* bigger = new Table((table.mask + 1) * 2);
+    Table* expected = nullptr;
+    if (!table.next.compare_exchange_strong(expected, bigger)) {
+      delete bigger;
+    }
+  }
+
+  uint32_t Find(const K& key) const { return Find(key, Mix(hasher(key))); }
+
+  // Walks from the current table to newer ones without helping a migration.
+  // A key goes into the first empty slot on its way and filled slots never
+  // change, so an empty slot before the key means that it is absent, and a
+  // closed one that it can only be in a newer table.
+  uint32_t Find(const K& key, uint64_t hash) const {
+    for (const Table* table = current.load(memory_order_acquire);;) {
+      for (size_t i = hash & table->mask, probes = 0;;
+           i = (i + 1) & table->mask) {
+        const uint64_t slot = table->slots[i].load(memory_order_acquire);
+        if (slot == EMPTY || probes++ > table->mask) {
+          return NO_ENTRY;
+        }
+        if (slot == MOVED) {
+          table = table->next.load(memory_order_acquire);
+          break;
+        }
+        if (HasTag(slot, hash) && GetEntry(ToEntry(slot)).key == key) {
+          return ToEntry(slot);
+        }
+      }
+    }
+  }
+
+  uint32_t FindOrInsert(const K& key) {
+    const uint64_t hash = Mix(hasher(key));
+    if (const uint32_t entry = Find(key, hash); entry != NO_ENTRY) {
+      return entry;
+    }
+    // Taken on the first empty slot and kept through retries; lost only when
+    // another thread inserts the same key first
+    uint32_t fresh = NO_ENTRY;
+    for (Table* table = current.load(memory_order_acquire);;) {
+      table = &Settle(table);
+      for (size_t i = hash & table->mask, probes = 0;;) {
+        uint64_t slot = table->slots[i].load(memory_order_acquire);
+        if (slot == MOVED) {
+          break;
+        }
+        // Racing inserts may fill a table past half, and in the worst case up
+        // to the brim
+        if (slot == EMPTY || probes > table->mask) {
+          if (table->size.load(memory_order_relaxed) * 2 > table->mask ||
+              probes > table->mask) {
+            StartResize(*table);
+            break;
+          }
+          if (fresh == NO_ENTRY) {
+            fresh = NewEntry(key);
+          }
+          if (table->slots[i].compare_exchange_strong(
+                  slot, ToSlot(hash, fresh), memory_order_acq_rel)) {
+            table->size.fetch_add(1, memory_order_relaxed);
+            return fresh;
+          }
+          // Somebody took the slot: look at what they put there
+          continue;
+        }
+        if (HasTag(slot, hash) && GetEntry(ToEntry(slot)).key == key) {
+          return ToEntry(slot);
+        }
+        i = (i + 1) & table->mask;
+        ++probes;
+      }
+    }
+  }
+};
+
+uint64_t NextInstanceId() {
+  static atomic<uint64_t> next_id = 1;
+  return next_id++;
+}
+
+// Counters over a ConcurrentMap for skewed keys: every thread adds into a
+// buffer of its own and only hands the sums over to the shared buckets, one
+// UpdateBatch at a time, once the buffer holds flush_size keys or on Flush.
+// BuildOrdinaryMap adds in what is still buffered, so its counts are exact.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class CombiningCounterMap {
+ public:
+  using MapType = unordered_map<K, V, Hash>;
+
+  explicit CombiningCounterMap(size_t bucket_count, size_t flush_size = 4096)
+      : shared(bucket_count), flush_size(flush_size) {}
+
+  void Add(const K& key, V delta = 1) {
+    Buffer& buffer = GetBuffer();
+    lock_guard lg(buffer.mtx);
+    buffer.deltas[key] += delta;
+    if (buffer.deltas.size() >= flush_size) {
+      FlushLocked(buffer);
+    }
+  }
+
+  // Hands over the sums of the calling thread.
+  void Flush() {
+    Buffer& buffer = GetBuffer();
+    lock_guard lg(buffer.mtx);
+    FlushLocked(buffer);
+  }
+
+  // Hands over the sums of every thread.
+  void FlushAll() {
+    lock_guard buffers_lg(buffers_mtx);
+    for (auto& buffer : buffers) {
+      lock_guard lg(buffer->mtx);
+      FlushLocked(*buffer);
+    }
+  }
+
+  // With every buffer locked no flush is halfway, so no sum is counted twice
+  // or missed.
+  MapType BuildOrdinaryMap() const {
+    lock_guard buffers_lg(buffers_mtx);
+    vector<unique_lock<mutex>> locks;
+    for (const auto& buffer : buffers) {
+      locks.emplace_back(buffer->mtx);
+    }
+
+    MapType result = shared.BuildOrdinaryMap();
+    for (const auto& buffer : buffers) {
+      for (const auto& [key, delta] : buffer->deltas) {
+        result[key] += delta;
+      }
+    }
+    return result;
+  }
+
+ private:
+  struct alignas(CACHE_LINE_SIZE) Buffer {
+    mutex mtx;
+    MapType deltas;
+  };
+
+  struct AddDelta {
+    V delta;
+
+    void operator()(V& value) const { value += delta; }
+  };
+
+  ConcurrentMap<K, V, Hash> shared;
+  const size_t flush_size;
+  const uint64_t id = NextInstanceId();
+  mutable mutex buffers_mtx;
+  vector<unique_ptr<Buffer>> buffers;
+
+  // Buffers outlive their threads, so nothing buffered is lost. Threads find
+  // theirs by the map's id, which unlike its address is never reused.
+  Buffer& GetBuffer() {
+    thread_local uint64_t last_id = 0;
+    thread_local Buffer* last_buffer = nullptr;
+    if (last_id == id) {
+      return *last_buffer;
+    }
+
+    thread_local unordered_map<uint64_t, Buffer*> thread_buffers;
+    Buffer*& buffer = thread_buffers[id];
+    if (!buffer) {
+      lock_guard lg(buffers_mtx);
+      buffers.push_back(make_unique<Buffer>());
+      buffer = buffers.back().get();
+    }
+    last_id = id;
+    last_buffer = buffer;
+    return *buffer;
+  }
+
+  void FlushLocked(Buffer& buffer) {
+    vector<pair<K, AddDelta>> updates;
+    updates.reserve(buffer.deltas.size());
+    for (const auto& [key, delta] : buffer.deltas) {
+      updates.push_back({key, AddDelta{delta}});
+    }
+    shared.UpdateBatch(updates.begin(), updates.end());
+    buffer.deltas.clear();
+  }
 };
 
-void RunConcurrentUpdates(ConcurrentMap<int, int>& cm,
+template <typename Map>
+void RunConcurrentUpdates(Map& cm,
                           size_t thread_count,
                           int key_count) {
   auto kernel = [&cm, key_count](int seed) {
@@ -77,7 +569,34 @@ void RunConcurrentUpdates(ConcurrentMap<int, int>& cm,
 
   vector<future<void>> futures;
   for (size_t i = 0; i < thread_count; ++i) {
-    futures.push_back(async(kernel, i));
+    futures.push_back(async(launch::async, kernel, i));
+  }
+}
+
+// The same updates as RunConcurrentUpdates, a pass over all keys per batch
+void RunBatchedUpdates(ConcurrentMap<int, int>& cm,
+                       size_t thread_count,
+                       int key_count) {
+  auto kernel = [&cm, key_count](int seed) {
+    vector<int> keys(key_count);
+    iota(begin(keys), end(keys), -key_count / 2);
+    shuffle(begin(keys), end(keys), default_random_engine(seed));
+
+    auto increment = [](int& value) { ++value; };
+    vector<pair<int, decltype(increment)>> updates;
+    updates.reserve(keys.size());
+    for (auto key : keys) {
+      updates.emplace_back(key, increment);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+      cm.UpdateBatch(updates.begin(), updates.end());
+    }
+  };
+
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; ++i) {
+    futures.push_back(async(launch::async, kernel, i));
   }
 }
 
@@ -140,6 +659,124 @@ void TestSpeedup() {
     LOG_DURATION("100 locks");
     RunConcurrentUpdates(many_locks, 4, 50000);
   }
+  {
+    ConcurrentMap<int, int> many_locks(100);
+
+    LOG_DURATION("100 locks, batched");
+    RunBatchedUpdates(many_locks, 4, 50000);
+  }
+  {
+    LockFreeMap<int, int> lock_free;
+
+    LOG_DURATION("Lock-free");
+    RunConcurrentUpdates(lock_free, 4, 50000);
+  }
+}
+
+// 1, 2, 4, ... threads up to the hardware concurrency
+vector<size_t> GetThreadCounts() {
+  const size_t max_threads = max(1u, thread::hardware_concurrency());
+  vector<size_t> thread_counts;
+  for (size_t thread_count = 1; thread_count < max_threads; thread_count *= 2) {
+    thread_counts.push_back(thread_count);
+  }
+  thread_counts.push_back(max_threads);
+  return thread_counts;
+}
+
+void TestScaling() {
+  const int key_count = 50000;
+
+  // Millions of updates per second
+  auto measure = [key_count](auto& cm, size_t thread_count) {
+    const auto start = chrono::steady_clock::now();
+    RunConcurrentUpdates(cm, thread_count, key_count);
+    const chrono::duration<double> elapsed =
+        chrono::steady_clock::now() - start;
+
+    const auto result = std::as_const(cm).BuildOrdinaryMap();
+    ASSERT(all_of(result.begin(), result.end(), [thread_count](auto& item) {
+      return item.second == static_cast<int>(2 * thread_count);
+    }));
+    return 2.0 * key_count * thread_count / elapsed.count() / 1e6;
+  };
+
+  for (size_t thread_count : GetThreadCounts()) {
+    ConcurrentMap<int, int> locked(thread_count * 16);
+    LockFreeMap<int, int> lock_free;
+    const double locked_speed = measure(locked, thread_count);
+    const double lock_free_speed = measure(lock_free, thread_count);
+    cerr << thread_count << " threads, M updates/s: locked " << locked_speed
+         << " (" << locked_speed / thread_count << " per thread), lock-free "
+         << lock_free_speed << " (" << lock_free_speed / thread_count
+         << " per thread)" << endl;
+  }
+}
+
+// Keys 0..key_count - 1, key k drawn with probability proportional to 1/(k+1)
+vector<int> MakeZipfianKeys(int key_count, size_t sample_count, int seed) {
+  vector<double> weights(key_count);
+  for (int k = 0; k < key_count; ++k) {
+    weights[k] = 1.0 / (k + 1);
+  }
+  discrete_distribution<int> distribution(weights.begin(), weights.end());
+  default_random_engine engine(seed);
+
+  vector<int> keys(sample_count);
+  for (auto& key : keys) {
+    key = distribution(engine);
+  }
+  return keys;
+}
+
+void TestZipfianCounters() {
+  const int key_count = 10000;
+  const size_t updates_per_thread = 200000;
+
+  for (size_t thread_count : GetThreadCounts()) {
+    vector<vector<int>> keys;
+    unordered_map<int, int> expected;
+    for (size_t i = 0; i < thread_count; ++i) {
+      keys.push_back(MakeZipfianKeys(key_count, updates_per_thread, i));
+      for (int key : keys.back()) {
+        ++expected[key];
+      }
+    }
+
+    // Millions of updates per second
+    auto measure = [&keys](auto kernel) {
+      const auto start = chrono::steady_clock::now();
+      vector<future<void>> futures;
+      for (const auto& thread_keys : keys) {
+        futures.push_back(async(launch::async, kernel, cref(thread_keys)));
+      }
+      futures.clear();
+      const chrono::duration<double> elapsed =
+          chrono::steady_clock::now() - start;
+      return keys.size() * updates_per_thread / elapsed.count() / 1e6;
+    };
+
+    ConcurrentMap<int, int> locked(64);
+    const double locked_speed =
+        measure([&locked](const vector<int>& thread_keys) {
+          for (int key : thread_keys) {
+            locked[key].ref_to_value++;
+          }
+        });
+
+    CombiningCounterMap<int, int> combining(64);
+    const double combining_speed =
+        measure([&combining](const vector<int>& thread_keys) {
+          for (int key : thread_keys) {
+            combining.Add(key);
+          }
+        });
+
+    cerr << thread_count << " threads, Zipfian M updates/s: locked "
+         << locked_speed << ", combining " << combining_speed << endl;
+    ASSERT(std::as_const(locked).BuildOrdinaryMap() == expected);
+    ASSERT(combining.BuildOrdinaryMap() == expected);
+  }
 }
 
 void TestConstAccess() {
@@ -241,13 +878,188 @@ void TestHas() {
   ASSERT(!const_map.Has(3));
 }
 
+void TestSharedReads() {
+  ConcurrentMap<int, int> cm(1);
+  cm[1].ref_to_value = 10;
+  cm[2].ref_to_value = 20;
+
+  // A second reader of the same bucket gets in while the first one holds
+  // its access
+  const auto& const_map = std::as_const(cm);
+  auto access = const_map.At(1);
+  auto other = async(launch::async, [&const_map] {
+    return const_map.At(2).ref_to_value + const_map.Has(1);
+  });
+  ASSERT(other.wait_for(chrono::seconds(5)) == future_status::ready);
+  ASSERT_EQUAL(other.get(), 21);
+  ASSERT_EQUAL(access.ref_to_value, 10);
+}
+
+void TestSnapshotDuringWrites() {
+  ConcurrentMap<int, int> cm(1);
+  atomic<bool> done = false;
+  auto writer = async(launch::async, [&cm, &done] {
+    for (int round = 1; round <= 200; ++round) {
+      for (int key = 0; key < 100; ++key) {
+        cm[key].ref_to_value = round;
+      }
+    }
+    done = true;
+  });
+
+  // A key never shows up without the keys written before it
+  while (!done) {
+    const auto snapshot = std::as_const(cm).BuildOrdinaryMap();
+    for (const auto& [key, value] : snapshot) {
+      if (key > 0) {
+        ASSERT(snapshot.count(key - 1));
+      }
+    }
+  }
+  writer.get();
+  ASSERT_EQUAL(std::as_const(cm).BuildOrdinaryMap().size(), 100u);
+}
+
+void TestLockFreeMap() {
+  // Starts small, so the updates run through several resizes
+  LockFreeMap<int, int> cm;
+  RunConcurrentUpdates(cm, 4, 50000);
+
+  const auto result = std::as_const(cm).BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), 50000u);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 8, "Key = " + to_string(k));
+  }
+
+  const auto& const_map = std::as_const(cm);
+  ASSERT(const_map.Has(-25000));
+  ASSERT(!const_map.Has(25000));
+  ASSERT_EQUAL(const_map.At(24999).ref_to_value.load(), 8);
+  try {
+    const_map.At(25000);
+    ASSERT(false);
+  } catch (out_of_range&) {
+  }
+
+  cm[7].ref_to_value.fetch_add(10, memory_order_relaxed);
+  ASSERT_EQUAL(const_map.At(7).ref_to_value.load(), 18);
+
+  // Keys already in stay visible to lookups while inserts resize the table
+  LockFreeMap<int, int> growing;
+  for (int i = 0; i < 1000; ++i) {
+    growing[i].ref_to_value = i;
+  }
+  atomic<bool> is_inserting = true;
+  auto lookups = async(launch::async, [&growing, &is_inserting] {
+    size_t misses = 0;
+    while (is_inserting) {
+      for (int i = 0; i < 1000; ++i) {
+        if (!growing.Has(i) || growing.At(i).ref_to_value.load() != i) {
+          ++misses;
+        }
+      }
+    }
+    return misses;
+  });
+  for (int i = 1000; i < 200000; ++i) {
+    growing[i];
+  }
+  is_inserting = false;
+  ASSERT_EQUAL(lookups.get(), 0u);
+
+  LockFreeMap<Point, size_t, PointHash> point_weight(10);
+  vector<future<void>> futures;
+  for (int i = 0; i < 8; ++i) {
+    futures.push_back(async(launch::async, [&point_weight, i] {
+      for (int j = 0; j < 1000; ++j) {
+        point_weight[Point{j, j % 7}].ref_to_value += i;
+      }
+    }));
+  }
+  futures.clear();
+  const auto weights = point_weight.BuildOrdinaryMap();
+  ASSERT_EQUAL(weights.size(), 1000u);
+  for (int j = 0; j < 1000; ++j) {
+    ASSERT_EQUAL(weights.at(Point{j, j % 7}), 28u);
+  }
+}
+
+void TestBatchedUpdates() {
+  ConcurrentMap<int, int> cm(16);
+  RunBatchedUpdates(cm, 3, 50000);
+
+  const auto result = std::as_const(cm).BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), 50000u);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 6, "Key = " + to_string(k));
+  }
+
+  // Updates of a key keep their order, whatever the other keys in between
+  ConcurrentMap<int, string> words(4);
+  auto append = [](char c) {
+    return [c](string& word) { word += c; };
+  };
+  vector<pair<int, function<void(string&)>>> updates;
+  for (int i = 0; i < 100; ++i) {
+    updates.emplace_back(i % 7, append('a' + i / 7));
+  }
+  updates.emplace_back(100, [](string& word) { word = "hundred"; });
+  words.UpdateBatch(updates.begin(), updates.end());
+  words.UpdateBatch(updates.end(), updates.end());
+
+  const auto built = words.BuildOrdinaryMap();
+  ASSERT_EQUAL(built.size(), 8u);
+  ASSERT_EQUAL(built.at(1), "abcdefghijklmno");
+  ASSERT_EQUAL(built.at(2), "abcdefghijklmn");
+  ASSERT_EQUAL(built.at(100), "hundred");
+}
+
+void TestCombiningCounters() {
+  CombiningCounterMap<string, int> counters(4, 3);
+  counters.Add("a", 5);
+
+  // Workers leave sums behind in their buffers when they finish
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; ++i) {
+    futures.push_back(async(launch::async, [&counters] {
+      for (int j = 0; j < 1000; ++j) {
+        counters.Add(to_string(j % 10));
+      }
+      counters.Add("a");
+    }));
+  }
+  futures.clear();
+
+  unordered_map<string, int> expected = {{"a", 9}};
+  for (int j = 0; j < 10; ++j) {
+    expected[to_string(j)] = 400;
+  }
+  ASSERT_EQUAL(counters.BuildOrdinaryMap(), expected);
+
+  counters.Flush();
+  ASSERT_EQUAL(counters.BuildOrdinaryMap(), expected);
+  counters.FlushAll();
+  ASSERT_EQUAL(counters.BuildOrdinaryMap(), expected);
+
+  counters.Add("b", -2);
+  expected["b"] = -2;
+  ASSERT_EQUAL(counters.BuildOrdinaryMap(), expected);
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestConcurrentUpdate);
   RUN_TEST(tr, TestReadAndWrite);
   RUN_TEST(tr, TestSpeedup);
+  RUN_TEST(tr, TestScaling);
   RUN_TEST(tr, TestConstAccess);
   RUN_TEST(tr, TestStringKeys);
   RUN_TEST(tr, TestUserType);
   RUN_TEST(tr, TestHas);
+  RUN_TEST(tr, TestSharedReads);
+  RUN_TEST(tr, TestSnapshotDuringWrites);
+  RUN_TEST(tr, TestLockFreeMap);
+  RUN_TEST(tr, TestBatchedUpdates);
+  RUN_TEST(tr, TestCombiningCounters);
+  RUN_TEST(tr, TestZipfianCounters);
 }
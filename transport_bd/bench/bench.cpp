@@ -0,0 +1,187 @@
+#include "../src/feed_generator.h"
+#include "../src/json.h"
+#include "../src/response_writer.h"
+#include "../src/transport.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+namespace {
+
+const size_t REQUESTS_PER_WRITER = 4096;
+
+void printUsage() {
+  cerr << "Usage: transport_bench [--input FILE | generator options] [--emit]\n"
+          "  --stops N --buses N --min-route N --max-route N\n"
+          "  --roundtrip-percent N --bus-requests N --stop-requests N\n"
+          "  --route-requests N --nearby-requests N --unknown-percent N\n"
+          "  --seed N --no-routing\n"
+          "  --threads N   threads for the throughput pass\n"
+          "  --emit        print the generated feed and exit\n";
+}
+
+double toMilliseconds(Clock::duration duration) {
+  return chrono::duration<double, milli>(duration).count();
+}
+
+long getPeakRssKb() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void printPercentiles(const string& name, vector<double> latencies) {
+  if (latencies.empty())
+    return;
+  sort(begin(latencies), end(latencies));
+  auto at = [&latencies](double share) {
+    return latencies[min(latencies.size() - 1,
+                         static_cast<size_t>(share * latencies.size()))];
+  };
+  cout << setw(6) << name << ": n=" << latencies.size() << " p50=" << at(0.5)
+       << " p90=" << at(0.9) << " p99=" << at(0.99)
+       << " p99.9=" << at(0.999) << " max=" << latencies.back() << " us\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  FeedParams params;
+  params.stopCount = 10000;
+  params.busCount = 2000;
+  params.busRequests = 50000;
+  params.stopRequests = 50000;
+  params.routeRequests = 1000;
+  params.nearbyRequests = 10000;
+  string inputPath;
+  bool isEmitOnly = false;
+  size_t threadCount = max(1u, thread::hardware_concurrency());
+
+  const map<string_view, function<void(const string&)>> setters = {
+      {"--input", [&](const string& value) { inputPath = value; }},
+      {"--stops",
+       [&](const string& value) { params.stopCount = stoull(value); }},
+      {"--buses",
+       [&](const string& value) { params.busCount = stoull(value); }},
+      {"--min-route",
+       [&](const string& value) { params.minRouteLength = stoull(value); }},
+      {"--max-route",
+       [&](const string& value) { params.maxRouteLength = stoull(value); }},
+      {"--roundtrip-percent",
+       [&](const string& value) { params.roundtripPercent = stoi(value); }},
+      {"--bus-requests",
+       [&](const string& value) { params.busRequests = stoull(value); }},
+      {"--stop-requests",
+       [&](const string& value) { params.stopRequests = stoull(value); }},
+      {"--route-requests",
+       [&](const string& value) { params.routeRequests = stoull(value); }},
+      {"--nearby-requests",
+       [&](const string& value) { params.nearbyRequests = stoull(value); }},
+      {"--unknown-percent",
+       [&](const string& value) { params.unknownNamePercent = stoi(value); }},
+      {"--seed", [&](const string& value) { params.seed = stoull(value); }},
+      {"--threads",
+       [&](const string& value) {
+         threadCount = max<size_t>(stoull(value), 1);
+       }},
+  };
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const string_view option = argv[i];
+      if (option == "--emit") {
+        isEmitOnly = true;
+      } else if (option == "--no-routing") {
+        params.hasRoutingSettings = false;
+      } else if (const auto it = setters.find(option); it == end(setters)) {
+        throw invalid_argument("Unknown option " + string(option));
+      } else if (i + 1 == argc) {
+        throw invalid_argument("Missing value of " + string(option));
+      } else {
+        it->second(argv[++i]);
+      }
+    }
+  } catch (const exception& e) {
+    cerr << e.what() << '\n';
+    printUsage();
+    return 1;
+  }
+
+  if (isEmitOnly) {
+    generateFeed(params, cout);
+    return 0;
+  }
+
+  string text;
+  if (!inputPath.empty()) {
+    ifstream input(inputPath, ios::binary);
+    if (!input) {
+      cerr << "Cannot open " << inputPath << '\n';
+      return 1;
+    }
+    text.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  } else {
+    ostringstream feed;
+    generateFeed(params, feed);
+    text = feed.str();
+  }
+  cout << fixed << setprecision(2);
+  cout << "input: " << text.size() / 1024 << " KiB\n";
+
+  auto start = Clock::now();
+  const auto document = Json::Load(vector<char>(begin(text), end(text)));
+  const auto& root = document.GetRoot();
+  cout << "parse: " << toMilliseconds(Clock::now() - start) << " ms\n";
+
+  start = Clock::now();
+  const BusManager manager = readBusManagerFromJson(root);
+  cout << "build: " << toMilliseconds(Clock::now() - start) << " ms\n";
+
+  // Each request timed on its own, serially
+  map<string, vector<double>> latencies;
+  vector<double>& all = latencies["all"];
+  const auto& requests = root.AsMap().at("stat_requests").AsArray();
+  auto writer = make_unique<ResponseWriter>();
+  for (size_t i = 0; i < requests.size(); ++i) {
+    if (i % REQUESTS_PER_WRITER == 0)
+      writer = make_unique<ResponseWriter>();
+    start = Clock::now();
+    processRequest(manager, requests[i], *writer);
+    const double latency =
+        chrono::duration<double, micro>(Clock::now() - start).count();
+    latencies[string(requests[i].AsMap().at("type").AsString())].push_back(
+        latency);
+    all.push_back(latency);
+  }
+  for (const auto& [type, typeLatencies] : latencies)
+    printPercentiles(type, typeLatencies);
+
+  start = Clock::now();
+  {
+    ResponseWriter sink;
+    processRequestsFromJson(manager, root, sink, threadCount);
+  }
+  const double total = toMilliseconds(Clock::now() - start);
+  cout << "throughput: " << requests.size() / max(total, 1e-3) * 1000
+       << " requests/s on " << threadCount << " threads\n";
+
+  cout << "peak RSS: " << getPeakRssKb() / 1024.0 << " MiB\n";
+  return 0;
+}
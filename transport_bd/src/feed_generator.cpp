@@ -0,0 +1,244 @@
+#include "feed_generator.h"
+#include "geo.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const double CITY_LATITUDE = 55.55;
+const double CITY_LONGITUDE = 37.35;
+const double CELL_DEGREES = 0.003;
+
+// splitmix64: unlike the standard distributions, gives the same sequence with
+// every standard library
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state(seed) {}
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+
+  size_t below(size_t bound) { return bound ? next() % bound : 0; }
+
+  double unit() { return (next() >> 11) * 0x1.0p-53; }
+
+  template <typename T>
+  void shuffle(vector<T>& items) {
+    for (size_t i = items.size(); i > 1; --i)
+      swap(items[i - 1], items[below(i)]);
+  }
+
+ private:
+  uint64_t state;
+};
+
+struct Route {
+  bool isRoundtrip = false;
+  vector<StopId> stops;
+};
+
+string stopName(size_t stop) {
+  return "Stop " + to_string(stop);
+}
+
+string busName(size_t bus) {
+  return "Bus " + to_string(bus);
+}
+
+vector<Route> makeRoutes(const FeedParams& params,
+                         size_t gridSide,
+                         Random& random) {
+  const size_t minLength = max<size_t>(params.minRouteLength, 2);
+  const size_t maxLength = max(params.maxRouteLength, minLength);
+
+  vector<Route> routes(params.busCount);
+  for (Route& route : routes) {
+    const size_t length = minLength + random.below(maxLength - minLength + 1);
+    size_t stop = random.below(params.stopCount);
+    route.stops.push_back(stop);
+    while (route.stops.size() < length) {
+      // One step to a neighbouring cell, staying inside the city
+      const size_t column = stop % gridSide;
+      const size_t row = stop / gridSide;
+      size_t next = stop;
+      switch (random.below(4)) {
+        case 0:
+          next = column + 1 < gridSide ? stop + 1 : stop - 1;
+          break;
+        case 1:
+          next = column > 0 ? stop - 1 : stop + 1;
+          break;
+        case 2:
+          next = stop + gridSide;
+          break;
+        default:
+          next = row > 0 ? stop - gridSide : stop + gridSide;
+      }
+      // Off the city a bus jumps to any other stop; only a city of one stop
+      // makes it stand still
+      if (next >= params.stopCount) {
+        do
+          next = random.below(params.stopCount);
+        while (next == stop && params.stopCount > 1);
+      }
+      route.stops.push_back(stop = next);
+    }
+
+    route.isRoundtrip = static_cast<int>(random.below(100)) <
+                        params.roundtripPercent;
+    if (route.isRoundtrip && route.stops.back() != route.stops.front())
+      route.stops.push_back(route.stops.front());
+  }
+  return routes;
+}
+
+// Declares every segment of every route once; a second of the declared pairs
+// also gets its own, different distance for the opposite direction.
+vector<vector<pair<StopId, int>>> makeRoadDistances(
+    const vector<Route>& routes,
+    const StopGeometry& geometry,
+    size_t stopCount,
+    Random& random) {
+  vector<vector<pair<StopId, int>>> distances(stopCount);
+  auto declare = [&](StopId from, StopId to) {
+    auto& declared = distances[from];
+    for (const auto& [other, distance] : declared)
+      if (other == to)
+        return false;
+    const double straight = geometry.measureRoute({from, to});
+    const double factor = 1.1 + 0.4 * random.unit();
+    declared.emplace_back(to, static_cast<int>(ceil(straight * factor)));
+    return true;
+  };
+
+  for (const Route& route : routes)
+    for (size_t i = 0; i + 1 < route.stops.size(); ++i) {
+      const StopId from = route.stops[i];
+      const StopId to = route.stops[i + 1];
+      if (from != to && declare(from, to) && random.below(2))
+        declare(to, from);
+    }
+  return distances;
+}
+
+}  // namespace
+
+void generateFeed(const FeedParams& params, ostream& output) {
+  Random random(params.seed);
+  const size_t stopCount = max<size_t>(params.stopCount, 1);
+  const size_t gridSide = max<size_t>(ceil(sqrt(stopCount)), 1);
+  FeedParams fixedParams = params;
+  fixedParams.stopCount = stopCount;
+
+  vector<pair<double, double>> coordinates(stopCount);
+  StopGeometry geometry;
+  geometry.resize(stopCount);
+  for (StopId stop = 0; stop < stopCount; ++stop) {
+    auto& [latitude, longitude] = coordinates[stop];
+    latitude = CITY_LATITUDE +
+               (stop / gridSide + 0.8 * random.unit()) * CELL_DEGREES;
+    longitude = CITY_LONGITUDE +
+                (stop % gridSide + 0.8 * random.unit()) * CELL_DEGREES;
+    geometry.set(stop, latitude, longitude);
+  }
+
+  const auto routes = makeRoutes(fixedParams, gridSide, random);
+  const auto distances =
+      makeRoadDistances(routes, geometry, stopCount, random);
+
+  output << setprecision(9) << "{";
+  if (params.hasRoutingSettings)
+    output << "\"routing_settings\": {\"bus_wait_time\": "
+           << 2 + random.below(10)
+           << ", \"bus_velocity\": " << 20 + random.below(40) << "},\n";
+
+  // Stops and buses come mixed, as real feeds do not sort them either
+  vector<size_t> baseOrder(stopCount + routes.size());
+  for (size_t i = 0; i < baseOrder.size(); ++i)
+    baseOrder[i] = i;
+  random.shuffle(baseOrder);
+
+  output << "\"base_requests\": [";
+  bool isFirst = true;
+  for (const size_t item : baseOrder) {
+    output << (isFirst ? "\n" : ",\n");
+    isFirst = false;
+    if (item < stopCount) {
+      output << "{\"type\": \"Stop\", \"name\": \"" << stopName(item)
+             << "\", \"latitude\": " << coordinates[item].first
+             << ", \"longitude\": " << coordinates[item].second
+             << ", \"road_distances\": {";
+      bool isFirstDistance = true;
+      for (const auto& [to, distance] : distances[item]) {
+        output << (isFirstDistance ? "" : ", ") << '"' << stopName(to)
+               << "\": " << distance;
+        isFirstDistance = false;
+      }
+      output << "}}";
+    } else {
+      const Route& route = routes[item - stopCount];
+      output << "{\"type\": \"Bus\", \"name\": \""
+             << busName(item - stopCount) << "\", \"is_roundtrip\": "
+             << (route.isRoundtrip ? "true" : "false") << ", \"stops\": [";
+      for (size_t i = 0; i < route.stops.size(); ++i)
+        output << (i ? ", " : "") << '"' << stopName(route.stops[i]) << '"';
+      output << "]}";
+    }
+  }
+  output << "],\n";
+
+  vector<char> types;
+  types.insert(end(types), params.busRequests, 'B');
+  types.insert(end(types), params.stopRequests, 'S');
+  types.insert(end(types), params.routeRequests, 'R');
+  types.insert(end(types), params.nearbyRequests, 'N');
+  random.shuffle(types);
+
+  auto pickStop = [&] {
+    const bool isUnknown =
+        static_cast<int>(random.below(100)) < params.unknownNamePercent;
+    return isUnknown ? "Unknown " + stopName(random.below(stopCount))
+                     : stopName(random.below(stopCount));
+  };
+
+  output << "\"stat_requests\": [";
+  for (size_t id = 0; id < types.size(); ++id) {
+    output << (id ? ",\n" : "\n") << "{\"id\": " << id << ", \"type\": ";
+    if (types[id] == 'B') {
+      const bool isUnknown =
+          static_cast<int>(random.below(100)) < params.unknownNamePercent;
+      const size_t bus = random.below(max<size_t>(routes.size(), 1));
+      output << "\"Bus\", \"name\": \""
+             << (isUnknown || routes.empty() ? "Unknown " : "")
+             << busName(bus) << "\"}";
+    } else if (types[id] == 'S') {
+      output << "\"Stop\", \"name\": \"" << pickStop() << "\"}";
+    } else if (types[id] == 'N') {
+      const double cityDegrees = gridSide * CELL_DEGREES;
+      output << "\"Nearby\", \"latitude\": "
+             << CITY_LATITUDE + random.unit() * cityDegrees
+             << ", \"longitude\": "
+             << CITY_LONGITUDE + random.unit() * cityDegrees;
+      if (random.below(2))
+        output << ", \"count\": " << 1 + random.below(10) << "}";
+      else
+        output << ", \"radius\": " << 100 * (1 + random.below(20)) << "}";
+    } else {
+      const string from = pickStop();
+      output << "\"Route\", \"from\": \"" << from << "\", \"to\": \""
+             << pickStop() << "\"}";
+    }
+  }
+  output << "]}\n";
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+struct FeedParams {
+  size_t stopCount = 1000;
+  size_t busCount = 100;
+  // Stops per route before a roundtrip returns to its first stop
+  size_t minRouteLength = 5;
+  size_t maxRouteLength = 30;
+  // Out of 100 buses
+  int roundtripPercent = 50;
+
+  size_t busRequests = 1000;
+  size_t stopRequests = 1000;
+  size_t routeRequests = 0;
+  // Each asks either for the k nearest stops or for those within a radius
+  size_t nearbyRequests = 0;
+  // Out of 100 stat requests, names nobody declared
+  int unknownNamePercent = 5;
+
+  bool hasRoutingSettings = true;
+  uint64_t seed = 1;
+};
+
+// Writes a city feed in the transport input format: stops scattered over a
+// grid, routes walking between neighbouring cells, road distances a bit longer
+// than the straight ones and stat requests of every type shuffled together.
+// The output depends on the parameters only, not on the platform.
+void generateFeed(const FeedParams& params, std::ostream& output);
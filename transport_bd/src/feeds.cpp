@@ -0,0 +1,130 @@
+#include "feeds.h"
+
+#include <algorithm>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+namespace {
+
+const size_t FEED_REQUESTS_BLOCK = 1024;
+
+// A run of consecutive requests to the same feed, answered into its own block
+struct RequestRun {
+  const BusManager* feed;
+  size_t first;
+  size_t last;
+};
+
+void writeNotFound(const Json::Node& request, ResponseWriter& writer) {
+  writer.beginResponse()
+      .write("{\n\"request_id\": ")
+      .writeNumber(request.AsMap().at("id").AsInt())
+      .write(",\n\"error_message\": \"not found\"\n}");
+}
+
+}  // namespace
+
+FeedHost::FeedHost() : names(make_shared<NamePool>()) {}
+
+const shared_ptr<NamePool>& FeedHost::getNames() const {
+  return names;
+}
+
+void FeedHost::addFeed(string name,
+                       BusManager manager,
+                       optional<size_t> memoryBudget) {
+  manager.finalize();
+  const size_t memoryUsage = manager.getMemoryUsage();
+  if (memoryBudget && memoryUsage > *memoryBudget)
+    throw length_error("Feed " + name + " needs " + to_string(memoryUsage) +
+                       " bytes, over its budget of " +
+                       to_string(*memoryBudget));
+  feeds.insert_or_assign(move(name), move(manager));
+}
+
+const BusManager* FeedHost::findFeed(string_view name) const {
+  const auto it = feeds.find(name);
+  return it == end(feeds) ? nullptr : &it->second;
+}
+
+size_t FeedHost::getFeedCount() const {
+  return feeds.size();
+}
+
+const BusManager* FeedHost::findRequestFeed(const Json::Dict& request) const {
+  if (const auto* feed = request.find("feed"))
+    return findFeed(feed->AsString());
+  return feeds.size() == 1 ? &begin(feeds)->second : nullptr;
+}
+
+void FeedHost::processRequests(const vector<Json::Node>& requests,
+                               ResponseWriter& writer) const {
+  vector<RequestRun> runs;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    const BusManager* feed = findRequestFeed(requests[i].AsMap());
+    if (runs.empty() || runs.back().feed != feed ||
+        runs.back().last - runs.back().first == FEED_REQUESTS_BLOCK)
+      runs.push_back({feed, i, i});
+    ++runs.back().last;
+  }
+
+  vector<ResponseWriter> blocks(runs.size());
+  map<const BusManager*, vector<size_t>> feedRuns;
+  for (size_t run = 0; run < runs.size(); ++run)
+    feedRuns[runs[run].feed].push_back(run);
+
+  vector<future<void>> workers;
+  for (const auto& [feed, runIds] : feedRuns)
+    workers.push_back(async(launch::async, [&, feed = feed, &runIds = runIds] {
+      for (const size_t run : runIds)
+        for (size_t i = runs[run].first; i < runs[run].last; ++i)
+          if (feed)
+            processRequest(*feed, requests[i], blocks[run]);
+          else
+            writeNotFound(requests[i], blocks[run]);
+    }));
+  for (auto& worker : workers)
+    worker.get();
+
+  for (const auto& block : blocks)
+    writer.appendResponses(block);
+}
+
+void processFeedsJson(const Json::Node& root, ResponseWriter& writer) {
+  FeedHost host;
+
+  vector<pair<string_view, future<BusManager>>> builds;
+  for (const auto& [name, feed] : root.AsMap().at("feeds").AsMap()) {
+    // A feed sure to outgrow its budget is not built at all
+    const auto* budget = feed.AsMap().find("memory_budget");
+    if (budget) {
+      const size_t estimate = BusManager::estimateMemoryUsage(feed);
+      if (estimate > budget->AsDouble()) {
+        cerr << "Skipping feed " << name << ": needs at least " << estimate
+             << " bytes, over its budget of " << budget->AsDouble() << endl;
+        continue;
+      }
+    }
+    builds.emplace_back(name, async(launch::async, [&host, &feed = feed] {
+                          return readBusManagerFromJson(feed, host.getNames());
+                        }));
+  }
+
+  for (auto& [name, build] : builds) {
+    try {
+      const auto* budget = root.AsMap().at("feeds").AsMap().at(name).AsMap()
+                               .find("memory_budget");
+      host.addFeed(string(name), build.get(),
+                   budget ? optional<size_t>(budget->AsDouble()) : nullopt);
+    } catch (const exception& e) {
+      cerr << "Skipping feed " << name << ": " << e.what() << endl;
+    }
+  }
+
+  host.processRequests(root.AsMap().at("stat_requests").AsArray(), writer);
+}
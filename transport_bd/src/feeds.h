@@ -0,0 +1,56 @@
+#pragma once
+
+#include "interner.h"
+#include "json.h"
+#include "response_writer.h"
+#include "transport.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Several named feeds served by one process. The feeds share a name pool, so
+// names common to several cities are stored once, and each feed may be given
+// a memory budget for its model.
+class FeedHost {
+ public:
+  FeedHost();
+
+  // The pool a feed's BusManager should be built with.
+  const std::shared_ptr<NamePool>& getNames() const;
+
+  // Finalizes the feed and takes it in unless its model outgrows
+  // memoryBudget bytes, in which case it throws length_error.
+  void addFeed(std::string name,
+               BusManager manager,
+               std::optional<size_t> memoryBudget = std::nullopt);
+
+  const BusManager* findFeed(std::string_view name) const;
+
+  size_t getFeedCount() const;
+
+  // Every request names its feed in "feed", which may be left out when only
+  // one feed is hosted. Each feed answers its requests on its own thread;
+  // responses keep the order of the requests.
+  void processRequests(const std::vector<Json::Node>& requests,
+                       ResponseWriter& writer) const;
+
+ private:
+  std::shared_ptr<NamePool> names;
+  std::map<std::string, BusManager, std::less<>> feeds;
+
+  const BusManager* findRequestFeed(const Json::Dict& request) const;
+};
+
+// Answers a document of the form
+//   {"feeds": {"<name>": {"base_requests": [...], "routing_settings": {...},
+//                         "memory_budget": <bytes>}, ...},
+//    "stat_requests": [{"feed": "<name>", ...}, ...]}
+// The feeds are built in parallel; one that fails to load or exceeds its
+// budget is reported to stderr and its requests are not found. A feed whose
+// base requests alone promise more than its budget is not even built.
+void processFeedsJson(const Json::Node& root, ResponseWriter& writer);
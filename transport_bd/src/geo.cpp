@@ -0,0 +1,88 @@
+#include "geo.h"
+#include "memory.h"
+#include "snapshot.h"
+
+#include <cmath>
+
+using namespace std;
+
+namespace {
+
+const double PI = 3.1415926535;
+const double EARTH_RADIUS = 6371000;
+const double POSITION_UNITS_PER_DEGREE = 1e7;
+
+double degToRad(double deg) {
+  return deg * (PI / 180);
+}
+
+}  // namespace
+
+StopPosition StopPosition::fromDegrees(double latitude, double longitude) {
+  StopPosition position;
+  position.latitude = lround(latitude * POSITION_UNITS_PER_DEGREE);
+  position.longitude = lround(longitude * POSITION_UNITS_PER_DEGREE);
+  return position;
+}
+
+double StopPosition::getLatitude() const {
+  return latitude / POSITION_UNITS_PER_DEGREE;
+}
+
+double StopPosition::getLongitude() const {
+  return longitude / POSITION_UNITS_PER_DEGREE;
+}
+
+void StopGeometry::resize(size_t stopCount) {
+  sinLatitudes.resize(stopCount);
+  cosLatitudes.resize(stopCount, 1);
+  longitudes.resize(stopCount);
+}
+
+void StopGeometry::set(StopId stop, double latitude, double longitude) {
+  sinLatitudes[stop] = sin(degToRad(latitude));
+  cosLatitudes[stop] = cos(degToRad(latitude));
+  longitudes[stop] = degToRad(longitude);
+}
+
+double StopGeometry::measureRoute(const vector<StopId>& stops) const {
+  if (stops.size() < 2)
+    return 0;
+
+  // Gather pass: the angle cosines of all segments
+  thread_local vector<double> cosines;
+  cosines.resize(stops.size() - 1);
+  for (size_t i = 0; i + 1 < stops.size(); ++i) {
+    const StopId lhs = stops[i];
+    const StopId rhs = stops[i + 1];
+    cosines[i] = sinLatitudes[lhs] * sinLatitudes[rhs] +
+                 cosLatitudes[lhs] * cosLatitudes[rhs] *
+                     cos(longitudes[lhs] - longitudes[rhs]);
+  }
+
+  // Dense pass with no indirection left
+  double angle = 0;
+  for (const double cosine : cosines)
+    angle += acos(cosine);
+  return angle * EARTH_RADIUS;
+}
+
+size_t StopGeometry::getMemoryUsage() const {
+  return getHeapBytes(sinLatitudes) + getHeapBytes(cosLatitudes) +
+         getHeapBytes(longitudes);
+}
+
+void StopGeometry::save(SnapshotWriter& writer) const {
+  writer.writeArray(sinLatitudes);
+  writer.writeArray(cosLatitudes);
+  writer.writeArray(longitudes);
+}
+
+void StopGeometry::load(SnapshotReader& reader, size_t stopCount) {
+  sinLatitudes = reader.readArray<double>();
+  cosLatitudes = reader.readArray<double>();
+  longitudes = reader.readArray<double>();
+  checkSnapshot(sinLatitudes.size() == stopCount &&
+                cosLatitudes.size() == stopCount &&
+                longitudes.size() == stopCount);
+}
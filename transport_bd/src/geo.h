@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ids.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class SnapshotReader;
+class SnapshotWriter;
+
+// Coordinates in units of 1e-7 degree, about a centimeter on the ground.
+struct StopPosition {
+  int32_t latitude = 0;
+  int32_t longitude = 0;
+
+  static StopPosition fromDegrees(double latitude, double longitude);
+
+  double getLatitude() const;
+  double getLongitude() const;
+};
+
+// Per-stop trigonometry kept as separate arrays, so measuring a route is a
+// gather over the stop ids followed by straight-line loops over doubles.
+class StopGeometry {
+ public:
+  void resize(size_t stopCount);
+
+  void set(StopId stop, double latitude, double longitude);
+
+  // Great-circle length of the path through `stops`, in meters.
+  double measureRoute(const std::vector<StopId>& stops) const;
+
+  size_t getMemoryUsage() const;
+
+  void save(SnapshotWriter& writer) const;
+  // Throws unless the snapshot holds exactly `stopCount` stops.
+  void load(SnapshotReader& reader, size_t stopCount);
+
+ private:
+  std::vector<double> sinLatitudes;
+  std::vector<double> cosLatitudes;
+  std::vector<double> longitudes;  // radians
+};
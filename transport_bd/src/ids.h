@@ -0,0 +1,6 @@
+#pragma once
+
+#include <cstdint>
+
+using StopId = uint32_t;
+using BusId = uint32_t;
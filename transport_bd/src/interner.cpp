@@ -0,0 +1,128 @@
+#include "interner.h"
+#include "memory.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+const size_t MIN_SLOT_COUNT = 16;
+const size_t POOL_CHUNK_BYTES = 1 << 16;
+
+}  // namespace
+
+string_view NamePool::store(string_view name) {
+  lock_guard lock(mutex);
+  if (const auto it = names.find(name); it != end(names))
+    return *it;
+
+  if (chunks.empty() || chunkBytes - chunkUsed < name.size()) {
+    chunkBytes = max(POOL_CHUNK_BYTES, name.size());
+    chunks.push_back(make_unique<char[]>(chunkBytes));
+    chunkUsed = 0;
+    totalBytes += chunkBytes;
+  }
+  char* const data = chunks.back().get() + chunkUsed;
+  memcpy(data, name.data(), name.size());
+  chunkUsed += name.size();
+  return *names.emplace(data, name.size()).first;
+}
+
+size_t NamePool::getMemoryUsage() const {
+  lock_guard lock(mutex);
+  // Roughly a node and a bucket per name besides the characters
+  return totalBytes + names.size() * (sizeof(string_view) + 3 * sizeof(void*));
+}
+
+StringInterner::StringInterner() : pool(make_shared<NamePool>()) {}
+
+StringInterner::StringInterner(shared_ptr<NamePool> pool)
+    : pool(move(pool)) {}
+
+uint32_t StringInterner::intern(string_view name) {
+  if (slots.empty())
+    rehash(MIN_SLOT_COUNT);
+
+  const size_t slot = findSlot(name);
+  if (slots[slot] != NO_ID)
+    return slots[slot];
+
+  const uint32_t id = names.size();
+  names.push_back(pool->store(name));
+  slots[slot] = id;
+
+  if (names.size() * 2 > slots.size())
+    rehash(slots.size() * 2);
+  return id;
+}
+
+optional<uint32_t> StringInterner::find(string_view name) const {
+  if (slots.empty())
+    return nullopt;
+  if (const uint32_t id = slots[findSlot(name)]; id != NO_ID)
+    return id;
+  return nullopt;
+}
+
+string_view StringInterner::getName(uint32_t id) const {
+  return names.at(id);
+}
+
+size_t StringInterner::size() const {
+  return names.size();
+}
+
+const shared_ptr<NamePool>& StringInterner::getPool() const {
+  return pool;
+}
+
+size_t StringInterner::getMemoryUsage() const {
+  return getHeapBytes(names) + getHeapBytes(slots);
+}
+
+// Linear probing: the slot holding `name`, or the empty slot it would take
+size_t StringInterner::findSlot(string_view name) const {
+  const size_t mask = slots.size() - 1;
+  for (size_t slot = hash<string_view>()(name) & mask;;
+       slot = (slot + 1) & mask)
+    if (slots[slot] == NO_ID || names[slots[slot]] == name)
+      return slot;
+}
+
+void StringInterner::rehash(size_t slotCount) {
+  slots.assign(slotCount, NO_ID);
+  for (uint32_t id = 0; id < names.size(); ++id)
+    slots[findSlot(names[id])] = id;
+}
+
+void StringInterner::save(SnapshotWriter& writer) const {
+  vector<char> chars;
+  vector<uint64_t> ends;
+  ends.reserve(names.size());
+  for (const string_view name : names) {
+    chars.insert(end(chars), begin(name), end(name));
+    ends.push_back(chars.size());
+  }
+  writer.writeArray(chars);
+  writer.writeArray(ends);
+}
+
+void StringInterner::load(SnapshotReader& reader) {
+  const auto chars = reader.readArray<char>();
+  const auto ends = reader.readArray<uint64_t>();
+  checkSnapshotEnds(ends, chars.size());
+
+  names.clear();
+  slots.clear();
+  uint64_t first = 0;
+  for (const uint64_t last : ends) {
+    intern(string_view(chars.data() + first, last - first));
+    first = last;
+  }
+  checkSnapshot(names.size() == ends.size());
+}
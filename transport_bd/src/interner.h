@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+class SnapshotReader;
+class SnapshotWriter;
+
+// Append-only storage for name characters that several interners can share,
+// so a name repeated across them is stored once. Safe to use from many
+// threads; stored names never move.
+class NamePool {
+ public:
+  // The returned view lives as long as the pool.
+  std::string_view store(std::string_view name);
+
+  size_t getMemoryUsage() const;
+
+ private:
+  mutable std::mutex mutex;
+  std::vector<std::unique_ptr<char[]>> chunks;
+  size_t chunkUsed = 0;
+  size_t chunkBytes = 0;
+  size_t totalBytes = 0;
+  std::unordered_set<std::string_view> names;
+};
+
+// Assigns every distinct name a dense id in order of first appearance. The
+// characters live in a NamePool, either a private one or one shared with
+// other interners; ids are found through an open-addressing table.
+class StringInterner {
+ public:
+  StringInterner();
+  explicit StringInterner(std::shared_ptr<NamePool> pool);
+
+  uint32_t intern(std::string_view name);
+
+  std::optional<uint32_t> find(std::string_view name) const;
+
+  // The view lives as long as the pool.
+  std::string_view getName(uint32_t id) const;
+
+  size_t size() const;
+
+  const std::shared_ptr<NamePool>& getPool() const;
+
+  // Excludes the pool, which may be shared.
+  size_t getMemoryUsage() const;
+
+  void save(SnapshotWriter& writer) const;
+  void load(SnapshotReader& reader);
+
+ private:
+  static constexpr uint32_t NO_ID = UINT32_MAX;
+
+  std::shared_ptr<NamePool> pool;
+  std::vector<std::string_view> names;
+  // A power of two in size and at most half full
+  std::vector<uint32_t> slots;
+
+  size_t findSlot(std::string_view name) const;
+
+  void rehash(size_t slotCount);
+};
@@ -1,98 +1,333 @@
 #include "json.h"
 
-#include <iostream>
+#include <charconv>
+#include <stdexcept>
+#include <string>
 
 using namespace std;
 
 namespace Json {
 
-Document::Document(Node root) : root(move(root)) {}
+void Dict::emplace(string_view key, Node value) {
+  items.emplace_back(key, move(value));
+}
+
+const Node* Dict::find(string_view key) const {
+  for (const auto& [itemKey, value] : items)
+    if (itemKey == key)
+      return &value;
+  return nullptr;
+}
+
+const Node& Dict::at(string_view key) const {
+  if (const Node* value = find(key))
+    return *value;
+  throw out_of_range("No key " + string(key) + " in JSON object");
+}
+
+size_t Dict::count(string_view key) const {
+  return find(key) ? 1 : 0;
+}
+
+Document::Document(vector<char> text, Node root)
+    : text(move(text)), root(move(root)) {}
 
 const Node& Document::GetRoot() const {
   return root;
 }
 
-Node LoadNode(istream& input);
+namespace {
 
-Node LoadArray(istream& input) {
-  vector<Node> result;
+const size_t READ_CHUNK = 1 << 16;
 
-  for (char c; input >> c && c != ']';) {
-    if (c != ',') {
-      input.putback(c);
+// Recursive descent over a mutable buffer. Escaped strings are decoded in
+// place, so every string in the tree can be a view into the buffer.
+class Parser {
+ public:
+  Parser(char* begin, char* end) : pos(begin), end(end) {}
+
+  Node LoadNode() {
+    switch (Next()) {
+      case '[':
+        return LoadArray();
+      case '{':
+        return LoadDict();
+      case '"':
+        return LoadString();
+      default:
+        --pos;
+        return LoadValue();
     }
-    result.push_back(LoadNode(input));
   }
 
-  return Node(move(result));
-}
+  // Expects pos right after the opening quote.
+  Node LoadString() {
+    char* const begin = pos;
+    char* out = pos;
+    while (pos != end && *pos != '"') {
+      if (*pos != '\\') {
+        *out++ = *pos++;
+        continue;
+      }
+      if (++pos == end)
+        break;
+      switch (const char c = *pos++) {
+        case 'b':
+          *out++ = '\b';
+          break;
+        case 'f':
+          *out++ = '\f';
+          break;
+        case 'n':
+          *out++ = '\n';
+          break;
+        case 'r':
+          *out++ = '\r';
+          break;
+        case 't':
+          *out++ = '\t';
+          break;
+        case 'u':
+          out = DecodeCodePoint(out);
+          break;
+        default:
+          *out++ = c;
+      }
+    }
+    if (pos == end)
+      throw invalid_argument("Unterminated JSON string");
+    ++pos;
+    return Node(string_view(begin, out - begin));
+  }
 
-Node LoadBool(istream& input) {
-  string result;
-  while (isalpha(input.peek()))
-    result += tolower(input.get());
+ private:
+  char* pos;
+  char* end;
 
-  if (result == "true")
-    return true;
-  else
-    return false;
-}
+  char Next() {
+    while (pos != end && isspace(static_cast<unsigned char>(*pos)))
+      ++pos;
+    if (pos == end)
+      throw invalid_argument("Unexpected end of JSON input");
+    return *pos++;
+  }
+
+  Node LoadArray() {
+    vector<Node> result;
 
-Node LoadDouble(istream& input) {
-  string result;
-  while (isdigit(input.peek()) || input.peek() == '.' || input.peek() == '-') {
-    result += input.get();
+    for (char c = Next(); c != ']'; c = Next()) {
+      if (c != ',')
+        --pos;
+      result.push_back(LoadNode());
+    }
+
+    return Node(move(result));
   }
 
-  return Node(stod(result));
-}
+  Node LoadDict() {
+    Dict result;
 
-Node LoadValue(istream& input) {
-  if (isdigit(input.peek()) || input.peek() == '-')
-    return LoadDouble(input);
-  else
-    return LoadBool(input);
-}
+    for (char c = Next(); c != '}'; c = Next()) {
+      if (c == ',')
+        c = Next();
 
-Node LoadString(istream& input) {
-  string line;
-  getline(input, line, '"');
-  return Node(move(line));
-}
+      const string_view key = LoadString().AsString();
+      Next();
+      result.emplace(key, LoadNode());
+    }
 
-Node LoadDict(istream& input) {
-  map<string, Node> result;
+    return Node(move(result));
+  }
 
-  for (char c; input >> c && c != '}';) {
-    if (c == ',') {
-      input >> c;
+  uint32_t ReadHex4() {
+    uint32_t value = 0;
+    if (end - pos < 4 || from_chars(pos, pos + 4, value, 16).ptr != pos + 4)
+      throw invalid_argument("Invalid \\u escape in JSON string");
+    pos += 4;
+    return value;
+  }
+
+  // Writes the UTF-8 form of a \u escape; it never outgrows the escape.
+  char* DecodeCodePoint(char* out) {
+    uint32_t code = ReadHex4();
+    if (code >= 0xD800 && code < 0xDC00 && end - pos >= 6 && pos[0] == '\\' &&
+        pos[1] == 'u') {
+      pos += 2;
+      code = 0x10000 + ((code - 0xD800) << 10) + (ReadHex4() - 0xDC00);
     }
 
-    string key = LoadString(input).AsString();
-    input >> c;
-    result.emplace(move(key), LoadNode(input));
+    if (code < 0x80) {
+      *out++ = code;
+    } else if (code < 0x800) {
+      *out++ = 0xC0 | (code >> 6);
+      *out++ = 0x80 | (code & 0x3F);
+    } else if (code < 0x10000) {
+      *out++ = 0xE0 | (code >> 12);
+      *out++ = 0x80 | ((code >> 6) & 0x3F);
+      *out++ = 0x80 | (code & 0x3F);
+    } else {
+      *out++ = 0xF0 | (code >> 18);
+      *out++ = 0x80 | ((code >> 12) & 0x3F);
+      *out++ = 0x80 | ((code >> 6) & 0x3F);
+      *out++ = 0x80 | (code & 0x3F);
+    }
+    return out;
   }
 
-  return Node(move(result));
-}
+  Node LoadValue() {
+    if (isdigit(static_cast<unsigned char>(*pos)) || *pos == '-')
+      return LoadDouble();
+    else
+      return LoadBool();
+  }
 
-Node LoadNode(istream& input) {
-  char c;
-  input >> c;
-  if (c == '[') {
-    return LoadArray(input);
-  } else if (c == '{') {
-    return LoadDict(input);
-  } else if (c == '"') {
-    return LoadString(input);
-  } else {
-    input.putback(c);
-    return LoadValue(input);
+  Node LoadDouble() {
+    double result = 0;
+    const auto [ptr, ec] = from_chars(pos, end, result);
+    if (ec != errc())
+      throw invalid_argument("Invalid JSON number");
+    pos += ptr - pos;
+    return Node(result);
   }
-}
+
+  Node LoadBool() {
+    const char* const begin = pos;
+    while (pos != end && isalpha(static_cast<unsigned char>(*pos)))
+      ++pos;
+    return Node(string_view(begin, pos - begin) == "true");
+  }
+};
+
+// Streaming counterpart of Parser: reads the input through a fixed buffer and
+// reports events instead of building nodes.
+class EventReader {
+ public:
+  EventReader(istream& input, Handler& handler)
+      : input(input), handler(handler), buffer(READ_CHUNK) {}
+
+  void ReadNode() {
+    switch (Next()) {
+      case '[':
+        ReadArray();
+        break;
+      case '{':
+        ReadDict();
+        break;
+      case '"':
+        handler.String(ReadString());
+        break;
+      default:
+        --pos;
+        ReadValue();
+    }
+  }
+
+ private:
+  istream& input;
+  Handler& handler;
+  vector<char> buffer;
+  size_t pos = 0;
+  size_t size = 0;
+  string scratch;
+
+  bool Fill() {
+    if (pos != size)
+      return true;
+    input.read(buffer.data(), buffer.size());
+    pos = 0;
+    size = input.gcount();
+    return size != 0;
+  }
+
+  int Peek() {
+    return Fill() ? static_cast<unsigned char>(buffer[pos]) : EOF;
+  }
+
+  char Get() {
+    if (!Fill())
+      throw invalid_argument("Unexpected end of JSON input");
+    return buffer[pos++];
+  }
+
+  char Next() {
+    while (isspace(Peek()))
+      ++pos;
+    return Get();
+  }
+
+  void ReadArray() {
+    handler.StartArray();
+    for (char c = Next(); c != ']'; c = Next()) {
+      if (c != ',')
+        --pos;
+      ReadNode();
+    }
+    handler.EndArray();
+  }
+
+  void ReadDict() {
+    handler.StartObject();
+    for (char c = Next(); c != '}'; c = Next()) {
+      if (c == ',')
+        Next();
+      handler.Key(ReadString());
+      Next();
+      ReadNode();
+    }
+    handler.EndObject();
+  }
+
+  // Copies into the scratch buffer and decodes the escapes there, reusing
+  // Parser, since a string may cross a chunk boundary.
+  string_view ReadString() {
+    scratch.clear();
+    for (char c = Get(); c != '"'; c = Get()) {
+      scratch += c;
+      if (c == '\\')
+        scratch += Get();
+    }
+    scratch += '"';
+    return Parser(scratch.data(), scratch.data() + scratch.size())
+        .LoadString()
+        .AsString();
+  }
+
+  void ReadValue() {
+    scratch.clear();
+    while (isalnum(Peek()) || Peek() == '-' || Peek() == '+' || Peek() == '.')
+      scratch += Get();
+    if (scratch.empty())
+      throw invalid_argument("Unexpected character in JSON input");
+    const Node value =
+        Parser(scratch.data(), scratch.data() + scratch.size()).LoadNode();
+    if (isdigit(static_cast<unsigned char>(scratch[0])) || scratch[0] == '-')
+      handler.Number(value.AsDouble());
+    else
+      handler.Bool(value.AsBool());
+  }
+};
+
+}  // namespace
 
 Document Load(istream& input) {
-  return Document{LoadNode(input)};
+  vector<char> text;
+  size_t size = 0;
+  while (input) {
+    text.resize(size + READ_CHUNK);
+    input.read(text.data() + size, READ_CHUNK);
+    size += input.gcount();
+  }
+  text.resize(size);
+  return Load(move(text));
+}
+
+Document Load(vector<char> text) {
+  Node root = Parser(text.data(), text.data() + text.size()).LoadNode();
+  return Document{move(text), move(root)};
+}
+
+void ReadEvents(istream& input, Handler& handler) {
+  EventReader(input, handler).ReadNode();
 }
 
 }  // namespace Json
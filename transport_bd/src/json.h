@@ -1,41 +1,90 @@
 #pragma once
 
 #include <istream>
-#include <map>
-#include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
 namespace Json {
 
+class Node;
+
+// Object members in document order. Lookups scan linearly: objects in our
+// feeds have a handful of keys, and big ones are only ever iterated.
+class Dict {
+ public:
+  using Item = std::pair<std::string_view, Node>;
+
+  void emplace(std::string_view key, Node value);
+
+  const Node& at(std::string_view key) const;
+  const Node* find(std::string_view key) const;
+  size_t count(std::string_view key) const;
+
+  size_t size() const { return items.size(); }
+  bool empty() const { return items.empty(); }
+  auto begin() const { return items.begin(); }
+  auto end() const { return items.end(); }
+
+ private:
+  std::vector<Item> items;
+};
+
 class Node : std::variant<std::vector<Node>,
-                          std::map<std::string, Node>,
-                          std::string,
+                          Dict,
+                          std::string_view,
                           double,
                           bool> {
  public:
   using variant::variant;
 
   const auto& AsArray() const { return std::get<std::vector<Node>>(*this); }
-  const auto& AsMap() const {
-    return std::get<std::map<std::string, Node>>(*this);
-  }
+  const auto& AsMap() const { return std::get<Dict>(*this); }
   int AsInt() const { return static_cast<int>(std::get<double>(*this)); }
   double AsDouble() const { return std::get<double>(*this); }
   int AsBool() const { return std::get<bool>(*this); }
-  const auto& AsString() const { return std::get<std::string>(*this); }
+  std::string_view AsString() const { return std::get<std::string_view>(*this); }
 };
 
+// Strings and keys of the tree are views into the document's own buffer,
+// so nodes must not outlive the document they were loaded from.
 class Document {
  public:
-  explicit Document(Node root);
+  Document(std::vector<char> text, Node root);
+
+  Document(Document&&) = default;
+  Document& operator=(Document&&) = default;
 
   const Node& GetRoot() const;
 
  private:
+  std::vector<char> text;
   Node root;
 };
 
 Document Load(std::istream& input);
 
+Document Load(std::vector<char> text);
+
+// Receives the events of ReadEvents in document order. Views passed to the
+// callbacks point into the reader's buffers and die when the callback returns.
+class Handler {
+ public:
+  virtual ~Handler() = default;
+
+  virtual void StartObject() {}
+  virtual void Key(std::string_view) {}
+  virtual void EndObject() {}
+  virtual void StartArray() {}
+  virtual void EndArray() {}
+  virtual void String(std::string_view) {}
+  virtual void Number(double) {}
+  virtual void Bool(bool) {}
+};
+
+// Parses the input chunk by chunk without building a tree, so memory use does
+// not depend on the size of the document.
+void ReadEvents(std::istream& input, Handler& handler);
+
 }  // namespace Json
@@ -0,0 +1,28 @@
+#include "metrics.h"
+#include "transport.h"
+
+#include <csignal>
+#include <iostream>
+#include <string_view>
+#include <thread>
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+  Metrics::dumpOnSignal(SIGUSR1, cerr);
+
+  const string_view mode = argc > 1 ? argv[1] : "";
+  if (mode == "--stream")
+    processJsonStream();
+  else if (mode == "serve")
+    serveJsonLines();
+  else if (mode == "make_base" && argc > 2)
+    makeBase(cin, argv[2]);
+  else if (mode == "process_requests" && argc > 2)
+    processRequests(argv[2], cin, cout, thread::hardware_concurrency());
+  else
+    processJson(cin, cout, thread::hardware_concurrency());
+
+  Metrics::dump(cerr);
+  return 0;
+}
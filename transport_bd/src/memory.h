@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Heap bytes held by a vector of flat elements.
+template <typename T>
+size_t getHeapBytes(const std::vector<T>& values) {
+  return values.capacity() * sizeof(T);
+}
@@ -0,0 +1,255 @@
+#include "metrics.h"
+
+#ifdef TRANSPORT_METRICS
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace Metrics {
+
+namespace {
+
+const size_t TIMER_COUNT = static_cast<size_t>(Timer::COUNT);
+const size_t COUNTER_COUNT = static_cast<size_t>(Counter::COUNT);
+const size_t GAUGE_COUNT = static_cast<size_t>(Gauge::COUNT);
+
+const array<const char*, TIMER_COUNT> TIMER_NAMES = {
+    "parse",        "build",         "bus_request",
+    "stop_request", "route_request", "nearby_request"};
+const array<const char*, COUNTER_COUNT> COUNTER_NAMES = {
+    "base_stops", "base_buses", "not_found", "unknown_type"};
+const array<const char*, GAUGE_COUNT> GAUGE_NAMES = {
+    "model_bytes", "name_pool_bytes", "stops", "buses"};
+
+const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+const char* const QUANTILE_NAMES[] = {"p50", "p90", "p99", "p999"};
+
+// HDR-style buckets: values below 2 * SUB_BUCKETS get one bucket each, every
+// further power of two is split into SUB_BUCKETS equal parts. Values past
+// 2^(MAX_EXPONENT + 1) ns, about half an hour, share the last bucket.
+const int SUB_BUCKET_BITS = 4;
+const uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+const int MAX_EXPONENT = 40;
+const size_t BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+size_t toBucket(uint64_t value) {
+  value = min(value, (uint64_t(2) << MAX_EXPONENT) - 1);
+  if (value < SUB_BUCKETS)
+    return value;
+  const int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+}
+
+uint64_t getBucketTop(size_t bucket) {
+  if (bucket < SUB_BUCKETS)
+    return bucket;
+  const int shift = bucket / SUB_BUCKETS - 1;
+  return ((bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+}
+
+// Written by the owning thread only, read by dumps from any thread
+void bump(atomic<uint64_t>& value, uint64_t by) {
+  value.store(value.load(memory_order_relaxed) + by, memory_order_relaxed);
+}
+
+struct Histogram {
+  atomic<uint64_t> buckets[BUCKET_COUNT] = {};
+  atomic<uint64_t> count = 0;
+  atomic<uint64_t> total = 0;
+  atomic<uint64_t> maximum = 0;
+};
+
+struct ThreadMetrics {
+  Histogram histograms[TIMER_COUNT];
+  atomic<uint64_t> counters[COUNTER_COUNT] = {};
+};
+
+// Plain totals of many ThreadMetrics
+struct Totals {
+  struct Histogram {
+    vector<uint64_t> buckets = vector<uint64_t>(BUCKET_COUNT);
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t maximum = 0;
+  };
+  array<Histogram, TIMER_COUNT> histograms;
+  array<uint64_t, COUNTER_COUNT> counters = {};
+
+  void add(const ThreadMetrics& metrics) {
+    for (size_t timer = 0; timer < TIMER_COUNT; ++timer) {
+      const auto& from = metrics.histograms[timer];
+      Histogram& to = histograms[timer];
+      for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+        to.buckets[bucket] += from.buckets[bucket].load(memory_order_relaxed);
+      to.count += from.count.load(memory_order_relaxed);
+      to.total += from.total.load(memory_order_relaxed);
+      to.maximum = max(to.maximum, from.maximum.load(memory_order_relaxed));
+    }
+    for (size_t counter = 0; counter < COUNTER_COUNT; ++counter)
+      counters[counter] += metrics.counters[counter].load(memory_order_relaxed);
+  }
+};
+
+uint64_t getQuantile(const Totals::Histogram& histogram, double quantile) {
+  const uint64_t rank = max<uint64_t>(1, quantile * histogram.count + 0.5);
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+    seen += histogram.buckets[bucket];
+    if (seen >= rank)
+      return min(getBucketTop(bucket), histogram.maximum);
+  }
+  return histogram.maximum;
+}
+
+// Knows the metrics of every running thread and keeps the totals of the
+// finished ones
+class Registry {
+ public:
+  static Registry& get() {
+    static Registry instance;
+    return instance;
+  }
+
+  void add(ThreadMetrics* metrics) {
+    lock_guard lock(registryMutex);
+    running.push_back(metrics);
+  }
+
+  void remove(ThreadMetrics* metrics) {
+    lock_guard lock(registryMutex);
+    finished.add(*metrics);
+    running.erase(find(begin(running), end(running), metrics));
+  }
+
+  Totals collect() const {
+    lock_guard lock(registryMutex);
+    Totals totals = finished;
+    for (const ThreadMetrics* metrics : running)
+      totals.add(*metrics);
+    return totals;
+  }
+
+  void reset() {
+    lock_guard lock(registryMutex);
+    finished = Totals();
+    for (ThreadMetrics* metrics : running) {
+      for (Histogram& histogram : metrics->histograms) {
+        for (auto& bucket : histogram.buckets)
+          bucket = 0;
+        histogram.count = histogram.total = histogram.maximum = 0;
+      }
+      for (auto& counter : metrics->counters)
+        counter = 0;
+    }
+    for (auto& gauge : gauges)
+      gauge = 0;
+  }
+
+  atomic<uint64_t> gauges[GAUGE_COUNT] = {};
+
+ private:
+  mutable mutex registryMutex;
+  vector<ThreadMetrics*> running;
+  Totals finished;
+};
+
+class ThreadSlot {
+ public:
+  ThreadSlot() : metrics(make_unique<ThreadMetrics>()) {
+    Registry::get().add(metrics.get());
+  }
+
+  ~ThreadSlot() { Registry::get().remove(metrics.get()); }
+
+  ThreadMetrics& get() { return *metrics; }
+
+ private:
+  unique_ptr<ThreadMetrics> metrics;
+};
+
+ThreadMetrics& getThreadMetrics() {
+  thread_local ThreadSlot slot;
+  return slot.get();
+}
+
+}  // namespace
+
+void record(Timer timer, chrono::nanoseconds duration) {
+  const uint64_t value = max<int64_t>(duration.count(), 0);
+  Histogram& histogram =
+      getThreadMetrics().histograms[static_cast<size_t>(timer)];
+  bump(histogram.buckets[toBucket(value)], 1);
+  bump(histogram.count, 1);
+  bump(histogram.total, value);
+  if (value > histogram.maximum.load(memory_order_relaxed))
+    histogram.maximum.store(value, memory_order_relaxed);
+}
+
+void increment(Counter counter) {
+  bump(getThreadMetrics().counters[static_cast<size_t>(counter)], 1);
+}
+
+void set(Gauge gauge, uint64_t value) {
+  Registry::get().gauges[static_cast<size_t>(gauge)].store(
+      value, memory_order_relaxed);
+}
+
+void dump(ostream& output) {
+  const Totals totals = Registry::get().collect();
+
+  ostringstream json;
+  json << "{\"counters\": {";
+  for (size_t counter = 0; counter < COUNTER_COUNT; ++counter)
+    json << (counter ? ", \"" : "\"") << COUNTER_NAMES[counter]
+         << "\": " << totals.counters[counter];
+
+  json << "},\n\"gauges\": {";
+  for (size_t gauge = 0; gauge < GAUGE_COUNT; ++gauge)
+    json << (gauge ? ", \"" : "\"") << GAUGE_NAMES[gauge] << "\": "
+         << Registry::get().gauges[gauge].load(memory_order_relaxed);
+
+  json << "},\n\"latency_ns\": {";
+  for (size_t timer = 0; timer < TIMER_COUNT; ++timer) {
+    const Totals::Histogram& histogram = totals.histograms[timer];
+    json << (timer ? ",\n\"" : "\n\"") << TIMER_NAMES[timer]
+         << "\": {\"count\": " << histogram.count << ", \"mean\": "
+         << (histogram.count ? histogram.total / histogram.count : 0);
+    for (size_t i = 0; i < size(QUANTILES); ++i)
+      json << ", \"" << QUANTILE_NAMES[i]
+           << "\": " << getQuantile(histogram, QUANTILES[i]);
+    json << ", \"max\": " << histogram.maximum << "}";
+  }
+  json << "}}\n";
+
+  output << json.str() << flush;
+}
+
+void dumpOnSignal(int signal, ostream& output) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, signal);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  thread([signals, &output] {
+    for (int received; sigwait(&signals, &received) == 0;)
+      dump(output);
+  }).detach();
+}
+
+void reset() {
+  Registry::get().reset();
+}
+
+}  // namespace Metrics
+
+#endif
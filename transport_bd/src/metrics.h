@@ -0,0 +1,90 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Request counters, latency histograms and model gauges. They are compiled in
+// only with TRANSPORT_METRICS defined; otherwise the METRICS_* macros expand to
+// no-ops, their arguments are not evaluated and the functions are empty.
+namespace Metrics {
+
+enum class Timer {
+  PARSE,
+  BUILD,
+  BUS_REQUEST,
+  STOP_REQUEST,
+  ROUTE_REQUEST,
+  NEARBY_REQUEST,
+  COUNT
+};
+
+enum class Counter { BASE_STOPS, BASE_BUSES, NOT_FOUND, UNKNOWN_TYPE, COUNT };
+
+// Describe the model finalized last
+enum class Gauge { MODEL_BYTES, NAME_POOL_BYTES, STOPS, BUSES, COUNT };
+
+#ifdef TRANSPORT_METRICS
+
+// Every thread records into its own histograms and counters, so recording
+// takes no lock and no read-modify-write.
+void record(Timer timer, std::chrono::nanoseconds duration);
+
+void increment(Counter counter);
+
+void set(Gauge gauge, uint64_t value);
+
+// Writes the totals over all threads, finished ones included, as a JSON
+// object. Latencies are in nanoseconds, within 1/16 of the true value.
+void dump(std::ostream& output);
+
+// Dumps to output each time the process gets the signal. Must be called
+// before any other thread starts, so that all of them block the signal.
+void dumpOnSignal(int signal, std::ostream& output);
+
+// Forgets everything recorded so far; for tests.
+void reset();
+
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Timer timer)
+      : timer(timer), start(std::chrono::steady_clock::now()) {}
+
+  ~ScopedTimer() { record(timer, std::chrono::steady_clock::now() - start); }
+
+ private:
+  Timer timer;
+  std::chrono::steady_clock::time_point start;
+};
+
+#else
+
+inline void dump(std::ostream&) {}
+
+inline void dumpOnSignal(int, std::ostream&) {}
+
+inline void reset() {}
+
+#endif
+
+}  // namespace Metrics
+
+#ifdef TRANSPORT_METRICS
+
+#define METRICS_CONCAT_IMPL(lhs, rhs) lhs##rhs
+#define METRICS_CONCAT(lhs, rhs) METRICS_CONCAT_IMPL(lhs, rhs)
+
+#define METRICS_TIMER(timer)                     \
+  const Metrics::ScopedTimer METRICS_CONCAT(     \
+      metricsTimer, __LINE__)(Metrics::Timer::timer)
+#define METRICS_COUNT(counter) Metrics::increment(Metrics::Counter::counter)
+#define METRICS_GAUGE(gauge, value) \
+  Metrics::set(Metrics::Gauge::gauge, (value))
+
+#else
+
+#define METRICS_TIMER(timer) static_cast<void>(0)
+#define METRICS_COUNT(counter) static_cast<void>(0)
+#define METRICS_GAUGE(gauge, value) static_cast<void>(0)
+
+#endif
@@ -0,0 +1,105 @@
+#include "response_writer.h"
+
+using namespace std;
+
+ResponseWriter::ResponseWriter(ostream* output, size_t flushThreshold)
+    : output(output), flushThreshold(flushThreshold) {
+  buffer.reserve(output ? flushThreshold + flushThreshold / 4 : 0);
+}
+
+ResponseWriter::~ResponseWriter() {
+  flush();
+}
+
+ResponseWriter& ResponseWriter::beginResponse() {
+  flushIfFull();
+  if (responseCount++ > 0)
+    buffer += ",\n";
+  return *this;
+}
+
+ResponseWriter& ResponseWriter::write(string_view text) {
+  buffer += text;
+  return *this;
+}
+
+ResponseWriter& ResponseWriter::write(char c) {
+  buffer += c;
+  return *this;
+}
+
+ResponseWriter& ResponseWriter::writeQuoted(string_view text) {
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  buffer += '"';
+  // Copies runs of plain characters at once, escapes the rest as JSON does
+  size_t plainStart = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    const unsigned char c = text[i];
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    buffer.append(text.data() + plainStart, i - plainStart);
+    plainStart = i + 1;
+    buffer += '\\';
+    switch (c) {
+      case '"':
+      case '\\':
+        buffer += c;
+        break;
+      case '\b':
+        buffer += 'b';
+        break;
+      case '\f':
+        buffer += 'f';
+        break;
+      case '\n':
+        buffer += 'n';
+        break;
+      case '\r':
+        buffer += 'r';
+        break;
+      case '\t':
+        buffer += 't';
+        break;
+      default:
+        buffer += "u00";
+        buffer += HEX_DIGITS[c >> 4];
+        buffer += HEX_DIGITS[c & 0xf];
+    }
+  }
+  buffer.append(text.data() + plainStart, text.size() - plainStart);
+  buffer += '"';
+  return *this;
+}
+
+ResponseWriter& ResponseWriter::writeNumber(double value) {
+  char chars[32];
+  const auto result =
+      to_chars(chars, chars + sizeof(chars), value, chars_format::general, 6);
+  buffer.append(chars, result.ptr);
+  return *this;
+}
+
+ResponseWriter& ResponseWriter::appendResponses(const ResponseWriter& other) {
+  if (other.responseCount == 0)
+    return *this;
+  beginResponse();
+  buffer += other.buffer;
+  responseCount += other.responseCount - 1;
+  return *this;
+}
+
+size_t ResponseWriter::getResponseCount() const {
+  return responseCount;
+}
+
+void ResponseWriter::flush() {
+  if (!output || buffer.empty())
+    return;
+  output->write(buffer.data(), buffer.size());
+  buffer.clear();
+}
+
+void ResponseWriter::flushIfFull() {
+  if (buffer.size() >= flushThreshold)
+    flush();
+}
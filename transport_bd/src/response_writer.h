@@ -0,0 +1,52 @@
+#pragma once
+
+#include <charconv>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Serializes responses into one reusable buffer. A writer bound to a stream
+// hands the buffer over in large chunks; an unbound one just accumulates, so
+// it can be spliced into another writer later.
+class ResponseWriter {
+ public:
+  explicit ResponseWriter(std::ostream* output = nullptr,
+                          size_t flushThreshold = 1 << 16);
+  ResponseWriter(ResponseWriter&&) = default;
+  ~ResponseWriter();
+
+  // Starts the next element of the response array.
+  ResponseWriter& beginResponse();
+
+  ResponseWriter& write(std::string_view text);
+  ResponseWriter& write(char c);
+  ResponseWriter& writeQuoted(std::string_view text);
+
+  // Formats like an ostream with precision(6).
+  ResponseWriter& writeNumber(double value);
+
+  template <typename Integer>
+  std::enable_if_t<std::is_integral_v<Integer>, ResponseWriter&> writeNumber(
+      Integer value) {
+    char chars[24];
+    const auto result = std::to_chars(chars, chars + sizeof(chars), value);
+    buffer.append(chars, result.ptr);
+    return *this;
+  }
+
+  // Appends every response of an unbound writer.
+  ResponseWriter& appendResponses(const ResponseWriter& other);
+
+  size_t getResponseCount() const;
+
+  void flush();
+
+ private:
+  std::ostream* output;
+  size_t flushThreshold;
+  size_t responseCount = 0;
+  std::string buffer;
+
+  void flushIfFull();
+};
@@ -0,0 +1,220 @@
+#include "road_distances.h"
+#include "memory.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+
+using namespace std;
+
+namespace {
+
+struct Edge {
+  StopId from;
+  StopId to;
+  bool isFallback;
+  double distance;
+};
+
+}  // namespace
+
+void RoadDistances::declare(StopId from,
+                            vector<pair<StopId, double>> distances) {
+  if (from >= declared.size())
+    declared.resize(from + 1);
+  if (!built) {
+    declared[from] = move(distances);
+    return;
+  }
+
+  vector<StopId> affected;
+  for (const auto& [to, distance] : declared[from])
+    affected.push_back(to);
+  for (const auto& [to, distance] : distances)
+    affected.push_back(to);
+  declared[from] = move(distances);
+
+  sort(begin(affected), end(affected));
+  affected.erase(unique(begin(affected), end(affected)), end(affected));
+  patchRow(from, from);
+  for (const StopId stop : affected)
+    if (stop != from)
+      patchRow(stop, from);
+
+  if (staleEntries > targets.size() / 2)
+    build(rowBegins.size());
+}
+
+// Only `declaredFrom` changed its declarations, so the stops that may have a
+// distance to `stop` are the targets already in its row, the ones it declares
+// itself and `declaredFrom`.
+void RoadDistances::patchRow(StopId stop, StopId declaredFrom) {
+  if (stop >= rowBegins.size()) {
+    rowBegins.resize(stop + 1, targets.size());
+    rowEnds.resize(stop + 1, targets.size());
+  }
+
+  vector<StopId> candidates(begin(targets) + rowBegins[stop],
+                            begin(targets) + rowEnds[stop]);
+  if (stop < declared.size())
+    for (const auto& [to, distance] : declared[stop])
+      candidates.push_back(to);
+  candidates.push_back(declaredFrom);
+  sort(begin(candidates), end(candidates));
+  candidates.erase(unique(begin(candidates), end(candidates)),
+                   end(candidates));
+
+  staleEntries += rowEnds[stop] - rowBegins[stop];
+  rowBegins[stop] = targets.size();
+  for (const StopId to : candidates)
+    if (const auto distance = getDeclared(stop, to)) {
+      targets.push_back(to);
+      distances.push_back(*distance);
+    }
+  rowEnds[stop] = targets.size();
+}
+
+void RoadDistances::build(size_t stopCount) {
+  vector<Edge> edges;
+  for (StopId from = 0; from < declared.size(); ++from)
+    for (const auto& [to, distance] : declared[from]) {
+      edges.push_back({from, to, false, distance});
+      edges.push_back({to, from, true, distance});
+    }
+
+  // Declared distances win over fallbacks, the first declaration wins over
+  // repeated ones.
+  stable_sort(begin(edges), end(edges), [](const Edge& lhs, const Edge& rhs) {
+    return tie(lhs.from, lhs.to, lhs.isFallback) <
+           tie(rhs.from, rhs.to, rhs.isFallback);
+  });
+  edges.erase(unique(begin(edges), end(edges),
+                     [](const Edge& lhs, const Edge& rhs) {
+                       return lhs.from == rhs.from && lhs.to == rhs.to;
+                     }),
+              end(edges));
+
+  stopCount = max(stopCount, declared.size());
+  rowBegins.assign(stopCount, 0);
+  rowEnds.assign(stopCount, 0);
+  targets.resize(edges.size());
+  distances.resize(edges.size());
+  targets.shrink_to_fit();
+  distances.shrink_to_fit();
+  for (size_t i = 0; i < edges.size(); ++i) {
+    ++rowEnds[edges[i].from];
+    targets[i] = edges[i].to;
+    distances[i] = edges[i].distance;
+  }
+  partial_sum(begin(rowEnds), end(rowEnds), begin(rowEnds));
+  for (StopId stop = 1; stop < stopCount; ++stop)
+    rowBegins[stop] = rowEnds[stop - 1];
+
+  staleEntries = 0;
+  built = true;
+}
+
+optional<double> RoadDistances::get(StopId from, StopId to) const {
+  if (!built)
+    return getDeclared(from, to);
+  if (from >= rowBegins.size())
+    return nullopt;
+
+  const auto first = begin(targets) + rowBegins[from];
+  const auto last = begin(targets) + rowEnds[from];
+  const auto it = lower_bound(first, last, to);
+  if (it == last || *it != to)
+    return nullopt;
+  return distances[it - begin(targets)];
+}
+
+size_t RoadDistances::getMemoryUsage() const {
+  size_t bytes = getHeapBytes(declared) + getHeapBytes(rowBegins) +
+                 getHeapBytes(rowEnds) + getHeapBytes(targets) +
+                 getHeapBytes(distances);
+  for (const auto& stopDistances : declared)
+    bytes += getHeapBytes(stopDistances);
+  return bytes;
+}
+
+optional<double> RoadDistances::getDeclared(StopId from, StopId to) const {
+  if (const auto distance = findDeclared(from, to))
+    return distance;
+  return findDeclared(to, from);
+}
+
+optional<double> RoadDistances::findDeclared(StopId from, StopId to) const {
+  if (from >= declared.size())
+    return nullopt;
+  for (const auto& [other, distance] : declared[from])
+    if (other == to)
+      return distance;
+  return nullopt;
+}
+
+void RoadDistances::save(SnapshotWriter& writer) const {
+  vector<uint64_t> declaredEnds;
+  vector<StopId> declaredTargets;
+  vector<double> declaredDistances;
+  for (const auto& stopDistances : declared) {
+    for (const auto& [to, distance] : stopDistances) {
+      declaredTargets.push_back(to);
+      declaredDistances.push_back(distance);
+    }
+    declaredEnds.push_back(declaredTargets.size());
+  }
+  writer.writeArray(declaredEnds);
+  writer.writeArray(declaredTargets);
+  writer.writeArray(declaredDistances);
+
+  // Rows are written back to back, dropping the slots left by patches
+  vector<uint32_t> offsets{0};
+  vector<StopId> liveTargets;
+  vector<double> liveDistances;
+  for (size_t stop = 0; stop < rowBegins.size(); ++stop) {
+    liveTargets.insert(end(liveTargets), begin(targets) + rowBegins[stop],
+                       begin(targets) + rowEnds[stop]);
+    liveDistances.insert(end(liveDistances),
+                         begin(distances) + rowBegins[stop],
+                         begin(distances) + rowEnds[stop]);
+    offsets.push_back(liveTargets.size());
+  }
+  writer.writeValue(built);
+  writer.writeArray(offsets);
+  writer.writeArray(liveTargets);
+  writer.writeArray(liveDistances);
+}
+
+void RoadDistances::load(SnapshotReader& reader, size_t stopCount) {
+  const auto declaredEnds = reader.readArray<uint64_t>();
+  const auto declaredTargets = reader.readArray<StopId>();
+  const auto declaredDistances = reader.readArray<double>();
+  checkSnapshot(declaredEnds.size() <= stopCount &&
+                declaredDistances.size() == declaredTargets.size());
+  checkSnapshotEnds(declaredEnds, declaredTargets.size());
+  checkSnapshotIds(declaredTargets, stopCount);
+  declared.assign(declaredEnds.size(), {});
+  uint64_t first = 0;
+  for (size_t from = 0; from < declaredEnds.size(); ++from) {
+    for (uint64_t i = first; i < declaredEnds[from]; ++i)
+      declared[from].emplace_back(declaredTargets[i], declaredDistances[i]);
+    first = declaredEnds[from];
+  }
+
+  built = reader.readValue<bool>();
+  const auto offsets = reader.readArray<uint32_t>();
+  targets = reader.readArray<StopId>();
+  distances = reader.readArray<double>();
+  checkSnapshot(offsets.size() <= stopCount + 1 &&
+                distances.size() == targets.size());
+  checkSnapshotEnds(offsets, targets.size());
+  checkSnapshotIds(targets, stopCount);
+  rowBegins.clear();
+  rowEnds.clear();
+  for (size_t stop = 0; stop + 1 < offsets.size(); ++stop) {
+    rowBegins.push_back(offsets[stop]);
+    rowEnds.push_back(offsets[stop + 1]);
+  }
+  staleEntries = 0;
+}
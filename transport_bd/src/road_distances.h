@@ -0,0 +1,47 @@
+#pragma once
+
+#include "ids.h"
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+class SnapshotReader;
+class SnapshotWriter;
+
+// Road distances between pairs of stops. Distances are declared per source
+// stop; build() freezes them into a CSR adjacency where a missing direction
+// already falls back to the distance declared for the opposite one.
+class RoadDistances {
+ public:
+  // Replaces every distance previously declared for `from`. Once built, only
+  // the rows of `from` and of the stops it names are patched.
+  void declare(StopId from, std::vector<std::pair<StopId, double>> distances);
+
+  void build(size_t stopCount);
+
+  std::optional<double> get(StopId from, StopId to) const;
+
+  size_t getMemoryUsage() const;
+
+  void save(SnapshotWriter& writer) const;
+  // Throws on stop ids outside `stopCount`.
+  void load(SnapshotReader& reader, size_t stopCount);
+
+ private:
+  std::vector<std::vector<std::pair<StopId, double>>> declared;
+  bool built = false;
+
+  // A patched row is appended at the end and its old slots are left behind
+  // until they outnumber the live ones.
+  std::vector<uint32_t> rowBegins;
+  std::vector<uint32_t> rowEnds;
+  std::vector<StopId> targets;
+  std::vector<double> distances;
+  size_t staleEntries = 0;
+
+  std::optional<double> getDeclared(StopId from, StopId to) const;
+  std::optional<double> findDeclared(StopId from, StopId to) const;
+
+  void patchRow(StopId stop, StopId declaredFrom);
+};
@@ -0,0 +1,320 @@
+#include "router.h"
+#include "memory.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+const double INF = numeric_limits<double>::infinity();
+const uint32_t NONE = numeric_limits<uint32_t>::max();
+const size_t ALL_PAIRS_MAX_STOPS = 512;
+const size_t ALL_PAIRS_MAX_ENTRIES = size_t(1) << 20;
+
+}  // namespace
+
+// Per-thread scratch space reused across queries. Only the entries touched by
+// a query are reset afterwards, and the heap is indexed so that relaxing an
+// edge is a decrease-key instead of a duplicate push.
+struct Router::Workspace {
+  vector<double> times;
+  vector<uint32_t> prevEdges;
+  vector<uint32_t> heapPositions;
+  vector<uint32_t> heap;
+  vector<uint32_t> touched;
+
+  void prepare(size_t nodeCount) {
+    if (times.size() >= nodeCount)
+      return;
+    times.resize(nodeCount, INF);
+    prevEdges.resize(nodeCount, NONE);
+    heapPositions.resize(nodeCount, NONE);
+  }
+
+  void reset() {
+    for (const uint32_t node : touched) {
+      times[node] = INF;
+      prevEdges[node] = NONE;
+      heapPositions[node] = NONE;
+    }
+    touched.clear();
+    heap.clear();
+  }
+
+  void push(uint32_t node, double time, uint32_t edge) {
+    if (times[node] == INF)
+      touched.push_back(node);
+    times[node] = time;
+    prevEdges[node] = edge;
+    if (heapPositions[node] == NONE) {
+      heapPositions[node] = heap.size();
+      heap.push_back(node);
+    }
+    siftUp(heapPositions[node]);
+  }
+
+  uint32_t pop() {
+    const uint32_t top = heap.front();
+    heapPositions[top] = NONE;
+    heap.front() = heap.back();
+    heap.pop_back();
+    if (!heap.empty()) {
+      heapPositions[heap.front()] = 0;
+      siftDown(0);
+    }
+    return top;
+  }
+
+ private:
+  void place(size_t position, uint32_t node) {
+    heap[position] = node;
+    heapPositions[node] = position;
+  }
+
+  void siftUp(size_t position) {
+    const uint32_t node = heap[position];
+    while (position > 0) {
+      const size_t parent = (position - 1) / 2;
+      if (times[heap[parent]] <= times[node])
+        break;
+      place(position, heap[parent]);
+      position = parent;
+    }
+    place(position, node);
+  }
+
+  void siftDown(size_t position) {
+    const uint32_t node = heap[position];
+    for (;;) {
+      size_t child = 2 * position + 1;
+      if (child >= heap.size())
+        break;
+      if (child + 1 < heap.size() && times[heap[child + 1]] < times[heap[child]])
+        ++child;
+      if (times[node] <= times[heap[child]])
+        break;
+      place(position, heap[child]);
+      position = child;
+    }
+    place(position, node);
+  }
+};
+
+Router::Router(size_t stopCount, RoutingSettings settings)
+    : stopCount(stopCount), settings(settings) {}
+
+void Router::addRun(BusId bus,
+                    const vector<StopId>& stops,
+                    const vector<double>& segmentDistances) {
+  const double metersPerMinute = settings.busVelocity * 1000 / 60;
+  const size_t firstNode = getNodeCount();
+  if (firstNode + stops.size() >= NONE ||
+      pendingEdges.size() + 3 * stops.size() >= NONE)
+    throw length_error("The routing graph outgrows 32-bit ids");
+
+  for (size_t i = 0; i < stops.size(); ++i) {
+    const uint32_t node = firstNode + i;
+    rideBuses.push_back(bus);
+    if (i + 1 < stops.size()) {
+      pendingEdges.push_back({stops[i], node, settings.busWaitTime});
+      pendingEdges.push_back(
+          {node, node + 1, segmentDistances[i] / metersPerMinute});
+    }
+    if (i > 0)
+      pendingEdges.push_back({node, stops[i], 0});
+  }
+}
+
+void Router::build() {
+  const size_t nodeCount = getNodeCount();
+  offsets.assign(nodeCount + 1, 0);
+  for (const Edge& edge : pendingEdges)
+    ++offsets[edge.from + 1];
+  partial_sum(begin(offsets), end(offsets), begin(offsets));
+
+  const size_t edgeCount = pendingEdges.size();
+  edgeTargets.resize(edgeCount);
+  edgeWeights.resize(edgeCount);
+  edgeSources.resize(edgeCount);
+  vector<uint32_t> next(begin(offsets), end(offsets) - 1);
+  for (const Edge& edge : pendingEdges) {
+    const uint32_t id = next[edge.from]++;
+    edgeTargets[id] = edge.to;
+    edgeWeights[id] = edge.weight;
+    edgeSources[id] = edge.from;
+  }
+  pendingEdges.clear();
+  pendingEdges.shrink_to_fit();
+
+  allPairsTimes.clear();
+  allPairsPrevEdges.clear();
+  if (stopCount > ALL_PAIRS_MAX_STOPS ||
+      stopCount * nodeCount > ALL_PAIRS_MAX_ENTRIES)
+    return;
+
+  allPairsTimes.assign(stopCount * nodeCount, INF);
+  allPairsPrevEdges.assign(stopCount * nodeCount, NONE);
+  Workspace workspace;
+  for (StopId from = 0; from < stopCount; ++from) {
+    runDijkstra(from, nullopt, workspace);
+    for (const uint32_t node : workspace.touched) {
+      allPairsTimes[from * nodeCount + node] = workspace.times[node];
+      allPairsPrevEdges[from * nodeCount + node] = workspace.prevEdges[node];
+    }
+    workspace.reset();
+  }
+}
+
+optional<RouteInfo> Router::findRoute(StopId from, StopId to) const {
+  RouteInfo route;
+  if (!findRoute(from, to, route))
+    return nullopt;
+  return route;
+}
+
+bool Router::findRoute(StopId from, StopId to, RouteInfo& route) const {
+  if (from >= stopCount || to >= stopCount)
+    return false;
+
+  if (!allPairsTimes.empty()) {
+    const size_t row = from * getNodeCount();
+    const double time = allPairsTimes[row + to];
+    if (time == INF)
+      return false;
+    makeRoute(from, to, time, allPairsPrevEdges.data() + row, route);
+    return true;
+  }
+
+  thread_local Workspace workspace;
+  runDijkstra(from, to, workspace);
+  const bool isFound = workspace.times[to] != INF;
+  if (isFound)
+    makeRoute(from, to, workspace.times[to], workspace.prevEdges.data(),
+              route);
+  workspace.reset();
+  return isFound;
+}
+
+const RoutingSettings& Router::getSettings() const {
+  return settings;
+}
+
+size_t Router::getMemoryUsage() const {
+  return getHeapBytes(pendingEdges) + getHeapBytes(rideBuses) +
+         getHeapBytes(offsets) + getHeapBytes(edgeTargets) +
+         getHeapBytes(edgeWeights) + getHeapBytes(edgeSources) +
+         getHeapBytes(allPairsTimes) + getHeapBytes(allPairsPrevEdges);
+}
+
+size_t Router::getNodeCount() const {
+  return stopCount + rideBuses.size();
+}
+
+void Router::runDijkstra(StopId from,
+                         optional<StopId> to,
+                         Workspace& workspace) const {
+  workspace.prepare(getNodeCount());
+  workspace.push(from, 0, NONE);
+
+  while (!workspace.heap.empty()) {
+    const uint32_t node = workspace.pop();
+    if (node == to)
+      break;
+
+    const double time = workspace.times[node];
+    for (uint32_t edge = offsets[node]; edge < offsets[node + 1]; ++edge) {
+      const uint32_t target = edgeTargets[edge];
+      const double candidate = time + edgeWeights[edge];
+      if (candidate < workspace.times[target])
+        workspace.push(target, candidate, edge);
+    }
+  }
+}
+
+// Walks back from `to`: every ride ends by getting off a ride node, follows
+// the ride edges back and starts with the boarding edge from a stop
+void Router::makeRoute(StopId from,
+                       StopId to,
+                       double totalTime,
+                       const uint32_t* prevEdges,
+                       RouteInfo& route) const {
+  route.totalTime = totalTime;
+  route.rides.clear();
+  for (StopId stop = to; stop != from;) {
+    const uint32_t last = edgeSources[prevEdges[stop]];
+    RouteRide ride = {rideBuses[last - stopCount], 0, 0, 0};
+    uint32_t edge = prevEdges[last];
+    for (; edgeSources[edge] >= stopCount;
+         edge = prevEdges[edgeSources[edge]]) {
+      ride.time += edgeWeights[edge];
+      ++ride.spanCount;
+    }
+    ride.from = stop = edgeSources[edge];
+    route.rides.push_back(ride);
+  }
+  reverse(begin(route.rides), end(route.rides));
+}
+
+void Router::save(SnapshotWriter& writer) const {
+  writer.writeValue<uint64_t>(stopCount);
+  writer.writeValue(settings);
+  writer.writeArray(rideBuses);
+  writer.writeArray(offsets);
+  writer.writeArray(edgeTargets);
+  writer.writeArray(edgeWeights);
+  writer.writeArray(edgeSources);
+  writer.writeArray(allPairsTimes);
+  writer.writeArray(allPairsPrevEdges);
+}
+
+void Router::load(SnapshotReader& reader,
+                  size_t expectedStopCount,
+                  size_t busCount) {
+  stopCount = reader.readValue<uint64_t>();
+  settings = reader.readValue<RoutingSettings>();
+  pendingEdges.clear();
+  rideBuses = reader.readArray<BusId>();
+  offsets = reader.readArray<uint32_t>();
+  edgeTargets = reader.readArray<uint32_t>();
+  edgeWeights = reader.readArray<double>();
+  edgeSources = reader.readArray<uint32_t>();
+  allPairsTimes = reader.readArray<double>();
+  allPairsPrevEdges = reader.readArray<uint32_t>();
+
+  const size_t nodeCount = stopCount + rideBuses.size();
+  const size_t edgeCount = edgeTargets.size();
+  checkSnapshot(stopCount == expectedStopCount && nodeCount < NONE &&
+                offsets.size() == nodeCount + 1 &&
+                offsets.back() == edgeCount &&
+                edgeWeights.size() == edgeCount &&
+                edgeSources.size() == edgeCount);
+  checkSnapshotEnds(offsets, edgeCount);
+  checkSnapshotIds(rideBuses, busCount);
+  // makeRoute relies on every edge touching a ride node and leaving the node
+  // whose row holds it
+  for (uint32_t node = 0; node < nodeCount; ++node) {
+    for (uint32_t edge = offsets[node]; edge < offsets[node + 1]; ++edge) {
+      const uint32_t target = edgeTargets[edge];
+      checkSnapshot(edgeSources[edge] == node && target < nodeCount &&
+                    (node >= stopCount || target >= stopCount));
+    }
+  }
+
+  // Every reachable node of a precomputed row must lead back to its stop
+  const size_t tableSize = allPairsTimes.empty() ? 0 : stopCount * nodeCount;
+  checkSnapshot(allPairsTimes.size() == tableSize &&
+                allPairsPrevEdges.size() == tableSize);
+  for (size_t i = 0; i < tableSize; ++i) {
+    const size_t node = i % nodeCount;
+    const uint32_t edge = allPairsPrevEdges[i];
+    if (edge == NONE)
+      checkSnapshot(node == i / nodeCount || allPairsTimes[i] == INF);
+    else
+      checkSnapshot(edge < edgeCount && edgeTargets[edge] == node);
+  }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "ids.h"
+
+#include <optional>
+#include <vector>
+
+class SnapshotReader;
+class SnapshotWriter;
+
+struct RoutingSettings {
+  double busWaitTime = 0;  // minutes
+  double busVelocity = 0;  // km/h
+};
+
+// One ride of an itinerary; every ride starts with a wait at `from`.
+struct RouteRide {
+  BusId bus;
+  StopId from;
+  uint32_t spanCount;
+  double time;
+};
+
+struct RouteInfo {
+  double totalTime = 0;
+  std::vector<RouteRide> rides;
+};
+
+// Fastest itineraries over the bus network. Besides a node per stop, every
+// stop of every run gets a ride node: boarding leads from the stop to the ride
+// node and costs the wait, riding leads on to the next ride node of the run,
+// and getting off leads back to the stop for free. The graph thus grows with
+// the total length of the runs, and a path is a sequence of rides with
+// transfers in between. It is frozen into a CSR layout by build().
+class Router {
+ public:
+  Router() = default;
+  Router(size_t stopCount, RoutingSettings settings);
+
+  // segmentDistances[i] is the road distance from stops[i] to stops[i + 1].
+  void addRun(BusId bus,
+              const std::vector<StopId>& stops,
+              const std::vector<double>& segmentDistances);
+
+  void build();
+
+  std::optional<RouteInfo> findRoute(StopId from, StopId to) const;
+
+  // The same into `route`, reusing the capacity of its rides; returns false
+  // and leaves `route` unspecified when `to` cannot be reached.
+  bool findRoute(StopId from, StopId to, RouteInfo& route) const;
+
+  const RoutingSettings& getSettings() const;
+
+  size_t getMemoryUsage() const;
+
+  // Only a built router can be saved.
+  void save(SnapshotWriter& writer) const;
+  // Throws unless the graph has `expectedStopCount` stops and its buses are
+  // below `busCount`.
+  void load(SnapshotReader& reader,
+            size_t expectedStopCount,
+            size_t busCount);
+
+ private:
+  struct Edge {
+    uint32_t from;
+    uint32_t to;
+    double weight;
+  };
+
+  size_t stopCount = 0;
+  RoutingSettings settings;
+  std::vector<Edge> pendingEdges;
+  // The bus of every ride node; ride node n is node stopCount + n
+  std::vector<BusId> rideBuses;
+
+  // Hot arrays scanned by Dijkstra
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> edgeTargets;
+  std::vector<double> edgeWeights;
+  // Cold array used only to rebuild the itinerary
+  std::vector<uint32_t> edgeSources;
+
+  // Filled for small networks: shortest times and last edges from every stop
+  // to every node, row-major by the stop
+  std::vector<double> allPairsTimes;
+  std::vector<uint32_t> allPairsPrevEdges;
+
+  struct Workspace;
+
+  size_t getNodeCount() const;
+
+  // Stops early once `to` is settled; without `to` settles every node.
+  void runDijkstra(StopId from,
+                   std::optional<StopId> to,
+                   Workspace& workspace) const;
+
+  void makeRoute(StopId from,
+                 StopId to,
+                 double totalTime,
+                 const uint32_t* prevEdges,
+                 RouteInfo& route) const;
+};
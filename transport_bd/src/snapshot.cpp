@@ -0,0 +1,85 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[8] = {'T', 'R', 'B', 'D', 'S', 'N', 'A', 'P'};
+const uint64_t VERSION = 5;
+const size_t ALIGNMENT = 8;
+
+size_t alignUp(size_t size) {
+  return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+}  // namespace
+
+SnapshotWriter::SnapshotWriter(ostream& output) : output(output) {
+  output.write(MAGIC, sizeof(MAGIC));
+  output.write(reinterpret_cast<const char*>(&VERSION), sizeof(VERSION));
+}
+
+void SnapshotWriter::writeBlock(const void* data, size_t size) {
+  static const char padding[ALIGNMENT] = {};
+  const uint64_t blockSize = size;
+  output.write(reinterpret_cast<const char*>(&blockSize), sizeof(blockSize));
+  output.write(static_cast<const char*>(data), size);
+  output.write(padding, alignUp(size) - size);
+  if (!output)
+    throw runtime_error("Failed to write snapshot");
+}
+
+SnapshotReader::SnapshotReader(const string& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("Cannot open snapshot " + path);
+
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      data = static_cast<const char*>(mapped);
+      size = info.st_size;
+    }
+  }
+  close(fd);
+
+  uint64_t version = 0;
+  if (size >= sizeof(MAGIC) + sizeof(version) &&
+      memcmp(data, MAGIC, sizeof(MAGIC)) == 0)
+    memcpy(&version, data + sizeof(MAGIC), sizeof(version));
+  if (version != VERSION) {
+    if (data)
+      munmap(const_cast<char*>(data), size);
+    throw runtime_error(path + " is not a transport snapshot of version " +
+                        to_string(VERSION));
+  }
+  pos = sizeof(MAGIC) + sizeof(version);
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (data)
+    munmap(const_cast<char*>(data), size);
+}
+
+pair<const char*, size_t> SnapshotReader::readBlock() {
+  uint64_t blockSize = 0;
+  if (size - pos < sizeof(blockSize))
+    throw runtime_error("Truncated snapshot");
+  memcpy(&blockSize, data + pos, sizeof(blockSize));
+  pos += sizeof(blockSize);
+  if (size - pos < blockSize)
+    throw runtime_error("Truncated snapshot");
+
+  const char* block = data + pos;
+  pos += min(alignUp(blockSize), size - pos);
+  return {block, blockSize};
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Versioned binary snapshot: a header followed by length-prefixed blocks of
+// trivially copyable data, each padded to 8 bytes. Readers must consume the
+// blocks in the order they were written. Values go out byte for byte, so
+// types with padding inside must be written field by field instead.
+class SnapshotWriter {
+ public:
+  explicit SnapshotWriter(std::ostream& output);
+
+  template <typename T>
+  void writeArray(const std::vector<T>& values) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    writeBlock(values.data(), values.size() * sizeof(T));
+  }
+
+  template <typename T>
+  void writeValue(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    writeBlock(&value, sizeof(T));
+  }
+
+ private:
+  std::ostream& output;
+
+  void writeBlock(const void* data, size_t size);
+};
+
+// Maps the whole file into memory; blocks are handed out as bulk copies.
+class SnapshotReader {
+ public:
+  explicit SnapshotReader(const std::string& path);
+  SnapshotReader(const SnapshotReader&) = delete;
+  SnapshotReader& operator=(const SnapshotReader&) = delete;
+  ~SnapshotReader();
+
+  template <typename T>
+  std::vector<T> readArray() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const auto [data, size] = readBlock();
+    if (size % sizeof(T) != 0)
+      throw std::runtime_error("Corrupted snapshot block");
+    std::vector<T> values(size / sizeof(T));
+    if (size != 0)
+      std::memcpy(values.data(), data, size);
+    return values;
+  }
+
+  template <typename T>
+  T readValue() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const auto [data, size] = readBlock();
+    if (size != sizeof(T))
+      throw std::runtime_error("Corrupted snapshot block");
+    T value;
+    std::memcpy(&value, data, size);
+    return value;
+  }
+
+ private:
+  const char* data = nullptr;
+  size_t size = 0;
+  size_t pos = 0;
+
+  std::pair<const char*, size_t> readBlock();
+};
+
+// Loaders check what they read against the counts loaded before it, so a
+// damaged file fails here instead of indexing out of bounds later.
+inline void checkSnapshot(bool isConsistent) {
+  if (!isConsistent)
+    throw std::runtime_error("Corrupted snapshot");
+}
+
+// Row ends must not decrease and must stay within the array they split.
+template <typename End>
+void checkSnapshotEnds(const std::vector<End>& ends, size_t itemCount) {
+  End previous = 0;
+  for (const End last : ends) {
+    checkSnapshot(previous <= last);
+    previous = last;
+  }
+  checkSnapshot(previous <= itemCount);
+}
+
+template <typename Id>
+void checkSnapshotIds(const std::vector<Id>& ids, size_t count) {
+  for (const Id id : ids)
+    checkSnapshot(id < count);
+}
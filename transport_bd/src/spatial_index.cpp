@@ -0,0 +1,246 @@
+#include "spatial_index.h"
+#include "memory.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+namespace {
+
+const double PI = 3.1415926535;
+const double EARTH_RADIUS = 6371000;
+const size_t MIN_LOOSE_POINTS_TO_REBUILD = 64;
+
+double squaredDistance(const double (&lhs)[3], const double (&rhs)[3]) {
+  const double dx = lhs[0] - rhs[0];
+  const double dy = lhs[1] - rhs[1];
+  const double dz = lhs[2] - rhs[2];
+  return dx * dx + dy * dy + dz * dz;
+}
+
+void toUnitVector(double latitude, double longitude, double (&coords)[3]) {
+  const double lat = latitude * (PI / 180);
+  const double lon = longitude * (PI / 180);
+  coords[0] = cos(lat) * cos(lon);
+  coords[1] = cos(lat) * sin(lon);
+  coords[2] = sin(lat);
+}
+
+double chordToMeters(double squaredChord) {
+  return 2 * asin(min(1.0, sqrt(squaredChord) / 2)) * EARTH_RADIUS;
+}
+
+// Candidates of the running search as (squared chord, stop)
+vector<pair<double, StopId>>& getCandidates() {
+  thread_local vector<pair<double, StopId>> candidates;
+  candidates.clear();
+  return candidates;
+}
+
+void toNearbyStops(vector<pair<double, StopId>>& found, NearbyStops& result) {
+  sort(begin(found), end(found));
+  result.clear();
+  result.reserve(found.size());
+  for (const auto& [squaredChord, stop] : found)
+    result.emplace_back(stop, chordToMeters(squaredChord));
+}
+
+}  // namespace
+
+void SpatialIndex::add(StopId stop, double latitude, double longitude) {
+  Point point;
+  toUnitVector(latitude, longitude, point.coords);
+  point.stop = stop;
+  point.axis = 0;
+  point.isRemoved = false;
+  points.push_back(point);
+}
+
+void SpatialIndex::build() {
+  points.erase(remove_if(begin(points), end(points),
+                         [](const Point& point) { return point.isRemoved; }),
+               end(points));
+  points.insert(end(points), begin(loosePoints), end(loosePoints));
+  loosePoints.clear();
+  looseSlots.clear();
+  removedCount = 0;
+
+  buildRange(0, points.size());
+
+  treeSlots.clear();
+  for (uint32_t slot = 0; slot < points.size(); ++slot) {
+    const StopId stop = points[slot].stop;
+    if (stop >= treeSlots.size())
+      treeSlots.resize(stop + 1, NO_SLOT);
+    treeSlots[stop] = slot;
+  }
+}
+
+void SpatialIndex::update(StopId stop, double latitude, double longitude) {
+  if (stop < treeSlots.size() && treeSlots[stop] != NO_SLOT) {
+    points[treeSlots[stop]].isRemoved = true;
+    treeSlots[stop] = NO_SLOT;
+    ++removedCount;
+  }
+  if (stop >= looseSlots.size())
+    looseSlots.resize(stop + 1, NO_SLOT);
+  if (looseSlots[stop] == NO_SLOT) {
+    looseSlots[stop] = loosePoints.size();
+    loosePoints.emplace_back();
+  }
+
+  Point& point = loosePoints[looseSlots[stop]];
+  toUnitVector(latitude, longitude, point.coords);
+  point.stop = stop;
+  point.axis = 0;
+  point.isRemoved = false;
+
+  if (loosePoints.size() >
+      max(MIN_LOOSE_POINTS_TO_REBUILD, points.size() / 8))
+    build();
+}
+
+// Splits along the axis where the range is widest
+void SpatialIndex::buildRange(size_t first, size_t last) {
+  if (last - first <= 1)
+    return;
+
+  double spans[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    const auto [low, high] = minmax_element(
+        begin(points) + first, begin(points) + last,
+        [axis](const Point& lhs, const Point& rhs) {
+          return lhs.coords[axis] < rhs.coords[axis];
+        });
+    spans[axis] = high->coords[axis] - low->coords[axis];
+  }
+  const uint8_t axis = max_element(spans, spans + 3) - spans;
+
+  const size_t middle = first + (last - first) / 2;
+  nth_element(begin(points) + first, begin(points) + middle,
+              begin(points) + last,
+              [axis](const Point& lhs, const Point& rhs) {
+                return lhs.coords[axis] < rhs.coords[axis];
+              });
+  points[middle].axis = axis;
+
+  buildRange(first, middle);
+  buildRange(middle + 1, last);
+}
+
+// Calls visit(point, squaredChord) for the points within `bound`, which the
+// visitor may tighten as it goes.
+template <typename Visit>
+void SpatialIndex::searchAll(const double (&target)[3],
+                             double& bound,
+                             Visit& visit) const {
+  for (const Point& point : loosePoints)
+    if (const double squaredChord = squaredDistance(point.coords, target);
+        squaredChord <= bound)
+      visit(point, squaredChord);
+  search(target, 0, points.size(), bound, visit);
+}
+
+template <typename Visit>
+void SpatialIndex::search(const double (&target)[3],
+                          size_t first,
+                          size_t last,
+                          double& bound,
+                          Visit& visit) const {
+  if (first >= last)
+    return;
+
+  const size_t middle = first + (last - first) / 2;
+  const Point& point = points[middle];
+  if (const double squaredChord = squaredDistance(point.coords, target);
+      squaredChord <= bound && !point.isRemoved)
+    visit(point, squaredChord);
+  if (last - first == 1)
+    return;
+
+  const double delta = target[point.axis] - point.coords[point.axis];
+  if (delta < 0) {
+    search(target, first, middle, bound, visit);
+    if (delta * delta <= bound)
+      search(target, middle + 1, last, bound, visit);
+  } else {
+    search(target, middle + 1, last, bound, visit);
+    if (delta * delta <= bound)
+      search(target, first, middle, bound, visit);
+  }
+}
+
+NearbyStops SpatialIndex::findNearest(double latitude,
+                                      double longitude,
+                                      size_t count) const {
+  NearbyStops result;
+  findNearest(latitude, longitude, count, result);
+  return result;
+}
+
+NearbyStops SpatialIndex::findWithin(double latitude,
+                                     double longitude,
+                                     double radius) const {
+  NearbyStops result;
+  findWithin(latitude, longitude, radius, result);
+  return result;
+}
+
+void SpatialIndex::findNearest(double latitude,
+                               double longitude,
+                               size_t count,
+                               NearbyStops& result) const {
+  result.clear();
+  if (count == 0)
+    return;
+
+  double target[3];
+  toUnitVector(latitude, longitude, target);
+
+  // Max-heap of the best candidates so far; ties go to the smaller stop id
+  auto& best = getCandidates();
+  double bound = numeric_limits<double>::infinity();
+  auto visit = [&best, &bound, count](const Point& point,
+                                      double squaredChord) {
+    best.emplace_back(squaredChord, point.stop);
+    push_heap(begin(best), end(best));
+    if (best.size() > count) {
+      pop_heap(begin(best), end(best));
+      best.pop_back();
+    }
+    if (best.size() == count)
+      bound = best.front().first;
+  };
+  searchAll(target, bound, visit);
+  toNearbyStops(best, result);
+}
+
+void SpatialIndex::findWithin(double latitude,
+                              double longitude,
+                              double radius,
+                              NearbyStops& result) const {
+  double target[3];
+  toUnitVector(latitude, longitude, target);
+
+  const double angle = min(max(radius, 0.0) / EARTH_RADIUS, PI);
+  const double chord = 2 * sin(angle / 2);
+  double bound = chord * chord;
+
+  auto& found = getCandidates();
+  auto visit = [&found](const Point& point, double squaredChord) {
+    found.emplace_back(squaredChord, point.stop);
+  };
+  searchAll(target, bound, visit);
+  toNearbyStops(found, result);
+}
+
+size_t SpatialIndex::size() const {
+  return points.size() - removedCount + loosePoints.size();
+}
+
+size_t SpatialIndex::getMemoryUsage() const {
+  return getHeapBytes(points) + getHeapBytes(loosePoints) +
+         getHeapBytes(treeSlots) + getHeapBytes(looseSlots);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ids.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Stops found near a point, closest first, with great-circle distances in
+// meters.
+using NearbyStops = std::vector<std::pair<StopId, double>>;
+
+// Packed k-d tree over the stops as points on the unit sphere. Straight-line
+// (chord) distance between such points grows with the great-circle one, so
+// plain Euclidean pruning works and the poles and the antimeridian need no
+// special care. The tree is implicit: the root of a range is its middle
+// element.
+class SpatialIndex {
+ public:
+  void add(StopId stop, double latitude, double longitude);
+
+  void build();
+
+  // Moves an indexed stop or adds a new one after build. Moved points are kept
+  // aside and scanned linearly until there are enough of them to rebuild.
+  void update(StopId stop, double latitude, double longitude);
+
+  NearbyStops findNearest(double latitude,
+                          double longitude,
+                          size_t count) const;
+
+  // radius is in meters
+  NearbyStops findWithin(double latitude,
+                         double longitude,
+                         double radius) const;
+
+  // The same into `result`, reusing its capacity; the scratch space of the
+  // search is kept per thread, so a warm thread queries without allocating.
+  void findNearest(double latitude,
+                   double longitude,
+                   size_t count,
+                   NearbyStops& result) const;
+  void findWithin(double latitude,
+                  double longitude,
+                  double radius,
+                  NearbyStops& result) const;
+
+  size_t size() const;
+
+  size_t getMemoryUsage() const;
+
+ private:
+  static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+  struct Point {
+    double coords[3];
+    StopId stop;
+    uint8_t axis;
+    bool isRemoved;
+  };
+
+  std::vector<Point> points;
+  std::vector<Point> loosePoints;
+  // Positions of every stop in points and in loosePoints
+  std::vector<uint32_t> treeSlots;
+  std::vector<uint32_t> looseSlots;
+  size_t removedCount = 0;
+
+  void buildRange(size_t first, size_t last);
+
+  template <typename Visit>
+  void searchAll(const double (&target)[3], double& bound, Visit& visit) const;
+
+  template <typename Visit>
+  void search(const double (&target)[3],
+              size_t first,
+              size_t last,
+              double& bound,
+              Visit& visit) const;
+};
@@ -1,21 +1,1081 @@
 #include "tests.h"
+#include "../../profile.h"
+#include "../tests/allocation_counter.h"
+#include "feed_generator.h"
+#include "feeds.h"
 #include "json.h"
+#include "metrics.h"
+#include "versioned_manager.h"
 
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <thread>
 
 using namespace std;
 
 namespace {
 
 void TestJsonParser() {
-  string file = "/home/ilya/dev/cppRepos/transport_bd/src/requests.json";
+  // The sample feed lies next to this file
+  const string source = __FILE__;
+  const string file =
+      source.substr(0, source.find_last_of('/') + 1) + "requests.json";
 
   ifstream input(file);
-  if (input.is_open()) {
-    cout << "File is opened" << endl;
+  ASSERT(input.is_open());
+  processJson(input);
+}
+
+void TestJsonLoad() {
+  istringstream input(R"({"name": "Tolstopaltsevo \"Z\"\u00e9", "lat": -55.5e1,
+      "ok": true, "no": false, "list": [1, {}, []], "name": "duplicate"})");
+  const auto document = Json::Load(input);
+  const auto& root = document.GetRoot().AsMap();
+
+  ASSERT_EQUAL(root.size(), 6u);
+  ASSERT_EQUAL(root.at("name").AsString(), "Tolstopaltsevo \"Z\"\xc3\xa9");
+  ASSERT_EQUAL(root.at("lat").AsDouble(), -555);
+  ASSERT(root.at("ok").AsBool());
+  ASSERT(!root.at("no").AsBool());
+  ASSERT_EQUAL(root.at("list").AsArray().size(), 3u);
+  ASSERT(root.at("list").AsArray()[1].AsMap().empty());
+  ASSERT_EQUAL(root.count("missing"), 0u);
+}
+
+void TestStringInterner() {
+  StringInterner interner;
+  ASSERT_EQUAL(interner.intern("Marushkino"), 0u);
+  ASSERT_EQUAL(interner.intern("Rasskazovka"), 1u);
+  ASSERT_EQUAL(interner.intern("Marushkino"), 0u);
+  ASSERT_EQUAL(interner.size(), 2u);
+
+  const StringInterner copy = interner;
+  ASSERT_EQUAL(*copy.find("Rasskazovka"), 1u);
+  ASSERT_EQUAL(copy.getName(0), "Marushkino");
+  ASSERT(!copy.find("Tolstopaltsevo"));
+}
+
+void TestBusStatsCache() {
+  BusManager manager;
+  Stop first("A", 55.611087, 37.20829);
+  first.addDistance("B", 3900);
+  manager.addStop(first);
+  manager.addStop(Stop("B", 55.595884, 37.209755));
+
+  Bus bus;
+  bus.setNumber("750").setIsCircle(true);
+  bus.addStop(manager.internStop("A"));
+  bus.addStop(manager.internStop("B"));
+  manager.addBus(bus);
+
+  const BusStats uncached = manager.getBusStats(0);
+  manager.finalize();
+  const BusStats cached = manager.getBusStats(0);
+  ASSERT_EQUAL(cached.stopCount, 3u);
+  ASSERT_EQUAL(cached.uniqueStopCount, 2);
+  ASSERT_EQUAL(cached.routeLength, 7800);
+  ASSERT_EQUAL(cached.curvature, uncached.curvature);
+
+  Stop changed("A", 55.611087, 37.20829);
+  changed.addDistance("B", 1000);
+  manager.addStop(changed);
+  ASSERT_EQUAL(manager.getBusStats(0).routeLength, 2000);
+}
+
+void TestRoadDistances() {
+  RoadDistances distances;
+  distances.declare(0, {{1, 3900}, {2, 100}, {1, 1}});
+  distances.declare(1, {{0, 4000}});
+  distances.declare(2, {{2, 50}});
+
+  for (const bool built : {false, true}) {
+    if (built)
+      distances.build(4);
+    ASSERT_EQUAL(*distances.get(0, 1), 3900);
+    ASSERT_EQUAL(*distances.get(1, 0), 4000);
+    ASSERT_EQUAL(*distances.get(2, 0), 100);
+    ASSERT_EQUAL(*distances.get(2, 2), 50);
+    ASSERT(!distances.get(1, 2));
+    ASSERT(!distances.get(3, 0));
+  }
+
+  distances.declare(0, {{3, 700}});
+  distances.build(4);
+  ASSERT_EQUAL(*distances.get(3, 0), 700);
+  ASSERT_EQUAL(*distances.get(0, 1), 4000);
+  ASSERT(!distances.get(2, 0));
+
+  // Declarations after build patch the rows in place
+  RoadDistances declaredOnly = distances;
+  for (StopId i = 0; i < 300; ++i) {
+    vector<pair<StopId, double>> row;
+    for (StopId j = 0; j < i % 4; ++j)
+      row.emplace_back((i * 7 + j * 3) % 12, i + j);
+    distances.declare(i * 5 % 11, row);
+    declaredOnly.declare(i * 5 % 11, row);
+  }
+  declaredOnly.build(12);
+  for (StopId from = 0; from < 12; ++from)
+    for (StopId to = 0; to < 12; ++to)
+      ASSERT(distances.get(from, to) == declaredOnly.get(from, to));
+}
+
+string GenerateFeed(const FeedParams& params) {
+  ostringstream output;
+  generateFeed(params, output);
+  return output.str();
+}
+
+void TestParallelSpeedup() {
+  FeedParams params;
+  params.stopCount = 10000;
+  params.busCount = 2000;
+  params.busRequests = 100000;
+  params.stopRequests = 100000;
+  params.hasRoutingSettings = false;
+  istringstream input(GenerateFeed(params));
+  const auto document = Json::Load(input);
+  const auto& root = document.GetRoot();
+  const BusManager manager = readBusManagerFromJson(root);
+
+  ostringstream serial;
+  {
+    ResponseWriter writer(&serial);
+    LOG_DURATION("Serial stat requests");
+    processRequestsFromJson(manager, root, writer, 1);
+    ASSERT_EQUAL(writer.getResponseCount(), 200000u);
+  }
+  ostringstream parallel;
+  {
+    ResponseWriter writer(&parallel);
+    LOG_DURATION("Parallel stat requests, " +
+                 to_string(thread::hardware_concurrency()) + " threads");
+    processRequestsFromJson(manager, root, writer,
+                            thread::hardware_concurrency());
+  }
+  ASSERT(serial.str() == parallel.str());
+}
+
+void TestStreamingMatchesDom() {
+  FeedParams params;
+  params.stopCount = 300;
+  params.busCount = 60;
+  params.routeRequests = 200;
+  params.nearbyRequests = 200;
+  const string text = GenerateFeed(params);
+  ostringstream expected;
+  {
+    istringstream input(text);
+    processJson(input, expected);
+  }
+  ostringstream streamed;
+  {
+    istringstream input(text);
+    processJsonStream(input, streamed);
+  }
+  ASSERT_EQUAL(streamed.str(), expected.str());
+
+  istringstream statsFirst(R"({"stat_requests": [
+      {"id": 1, "type": "Bus", "name": "750"},
+      {"id": 2, "type": "Stop", "name": "B"}],
+    "base_requests": [
+      {"type": "Bus", "name": "750", "stops": ["A", "B"], "is_roundtrip": false},
+      {"type": "Stop", "name": "A", "latitude": 55.61, "longitude": 37.20,
+       "road_distances": {"B": 3900}},
+      {"type": "Stop", "name": "B", "latitude": 55.59, "longitude": 37.20,
+       "road_distances": {}}]})");
+  ostringstream output;
+  processJsonStream(statsFirst, output);
+  ASSERT(output.str().find("\"route_length\": 7800") != string::npos);
+  ASSERT(output.str().find("\"750\"") != string::npos);
+}
+
+void TestResponseWriter() {
+  ostringstream output;
+  {
+    ResponseWriter writer(&output, 8);
+    ResponseWriter block;
+    block.beginResponse().writeNumber(2);
+    block.beginResponse().writeQuoted("three");
+
+    writer.beginResponse().writeNumber(1234567.0);
+    writer.appendResponses(block).appendResponses(ResponseWriter());
+    writer.beginResponse().writeNumber(1.318084).write(' ').writeNumber(-7);
+    ASSERT_EQUAL(writer.getResponseCount(), 4u);
+  }
+  ASSERT_EQUAL(output.str(), "1.23457e+06,\n2,\n\"three\",\n1.31808 -7");
+}
+
+void TestQuotedNamesRoundTrip() {
+  const vector<string> names = {"A \"Z\"", "7\\x", "tab\there\n",
+                                string("nul\0bell\x07", 9), "\xc3\xa9"};
+  ostringstream output;
+  {
+    ResponseWriter writer(&output);
+    for (const string& name : names)
+      writer.beginResponse().writeQuoted(name);
+  }
+  istringstream array("[" + output.str() + "]");
+  const auto document = Json::Load(array);
+  const auto& parsed = document.GetRoot().AsArray();
+  ASSERT_EQUAL(parsed.size(), names.size());
+  for (size_t i = 0; i < names.size(); ++i)
+    ASSERT_EQUAL(parsed[i].AsString(), names[i]);
+
+  // The names a feed declares come back unchanged in the responses
+  const string input = R"({"base_requests": [
+      {"type": "Stop", "name": "A \"Z\"", "latitude": 55.6,
+       "longitude": 37.2, "road_distances": {}},
+      {"type": "Bus", "name": "7\\x", "is_roundtrip": false,
+       "stops": ["A \"Z\""]}],
+    "stat_requests": [{"id": 1, "type": "Stop", "name": "A \"Z\""}]})";
+  for (const bool streamed : {false, true}) {
+    istringstream in(input);
+    stringstream out;
+    streamed ? processJsonStream(in, out) : processJson(in, out);
+    const auto responses = Json::Load(out);
+    const auto& buses =
+        responses.GetRoot().AsArray()[0].AsMap().at("buses").AsArray();
+    ASSERT_EQUAL(buses.size(), 1u);
+    ASSERT_EQUAL(buses[0].AsString(), "7\\x");
+  }
+}
+
+void TestRouter() {
+  // Two buses share stop 1; going 0 -> 2 is faster with a transfer there than
+  // riding bus 1 around, and stop 3 is unreachable. Stop count decides between
+  // the all-pairs tables and per-query Dijkstra.
+  for (const size_t stopCount : {4u, 1000u}) {
+    Router router(stopCount, {6, 36});
+    router.addRun(0, {0, 1}, {600});
+    router.addRun(1, {1, 2}, {1200});
+    router.addRun(1, {0, 1, 2, 0}, {5000, 5000, 5000});
+    router.build();
+
+    const auto route = router.findRoute(0, 2);
+    ASSERT(route.has_value());
+    ASSERT_EQUAL(route->totalTime, 15);
+    ASSERT_EQUAL(route->rides.size(), 2u);
+    ASSERT_EQUAL(route->rides[1].bus, 1u);
+    ASSERT_EQUAL(route->rides[1].from, 1u);
+    ASSERT_EQUAL(route->rides[1].spanCount, 1u);
+    ASSERT_EQUAL(route->rides[1].time, 2);
+
+    ASSERT_EQUAL(router.findRoute(2, 1)->rides.size(), 2u);
+    ASSERT(router.findRoute(1, 1)->rides.empty());
+    ASSERT(!router.findRoute(0, 3));
+  }
+}
+
+void TestRouterLongRoute() {
+  // The graph grows with the length of a run, not with its square
+  const StopId stopCount = 10000;
+  Router router(stopCount, {5, 36});
+  vector<StopId> run(stopCount);
+  for (StopId i = 0; i < stopCount; ++i)
+    run[i] = i;
+  router.addRun(0, run, vector<double>(stopCount - 1, 600));
+  router.build();
+  ASSERT(router.getMemoryUsage() < 100 * stopCount * sizeof(double));
+
+  const auto route = router.findRoute(1, stopCount - 1);
+  ASSERT(route.has_value());
+  ASSERT_EQUAL(route->rides.size(), 1u);
+  ASSERT_EQUAL(route->rides[0].from, 1u);
+  ASSERT_EQUAL(route->rides[0].spanCount, stopCount - 2);
+  ASSERT(abs(route->totalTime - (5 + (stopCount - 2))) < 1e-6);
+  ASSERT(!router.findRoute(stopCount - 1, 0));
+}
+
+void TestRouterSpeed() {
+  const StopId stopCount = 10000;
+  Router router(stopCount, {6, 40});
+  for (BusId bus = 0; bus < 500; ++bus) {
+    vector<StopId> run;
+    for (StopId i = 0; i < 30; ++i)
+      run.push_back((bus * 37 + i * 13) % stopCount);
+    router.addRun(bus, run, vector<double>(run.size() - 1, 800));
+  }
+  router.build();
+
+  size_t found = 0;
+  LOG_DURATION("10000 route queries over 10000 stops");
+  for (StopId i = 0; i < 10000; ++i)
+    found += router.findRoute(i * 7 % stopCount, i * 11 % stopCount).has_value();
+  ASSERT(found > 0);
+}
+
+void TestSnapshotRoundTrip() {
+  // Both phases read the same document and skip the part they do not need
+  FeedParams params;
+  params.stopCount = 300;
+  params.busCount = 60;
+  params.routeRequests = 500;
+  params.nearbyRequests = 200;
+  const string text = GenerateFeed(params);
+  const string snapshotPath = "transport_snapshot_test.bin";
+
+  istringstream baseInput(text);
+  makeBase(baseInput, snapshotPath);
+
+  ostringstream expected;
+  istringstream input(text);
+  processJson(input, expected);
+
+  ostringstream loaded;
+  istringstream statInput(text);
+  processRequests(snapshotPath, statInput, loaded);
+  ASSERT_EQUAL(loaded.str(), expected.str());
+
+  // The file depends on the model only: saving what was loaded gives it back
+  auto readFile = [](const string& path) {
+    ifstream file(path, ios::binary);
+    return string(istreambuf_iterator<char>(file), {});
+  };
+  {
+    SnapshotReader reader(snapshotPath);
+    const BusManager reloaded = BusManager::load(reader);
+    ofstream output(snapshotPath + ".again", ios::binary);
+    SnapshotWriter writer(output);
+    reloaded.save(writer);
+  }
+  ASSERT(readFile(snapshotPath + ".again") == readFile(snapshotPath));
+  remove((snapshotPath + ".again").c_str());
+  remove(snapshotPath.c_str());
+}
+
+void TestCorruptedSnapshot() {
+  istringstream input(R"({"routing_settings": {"bus_wait_time": 6,
+      "bus_velocity": 40}, "base_requests": [
+      {"type": "Bus", "name": "750", "stops": ["A", "B", "C", "D"],
+       "is_roundtrip": false},
+      {"type": "Stop", "name": "A", "latitude": 55.61, "longitude": 37.20,
+       "road_distances": {"B": 3900}},
+      {"type": "Stop", "name": "B", "latitude": 55.59, "longitude": 37.20,
+       "road_distances": {"C": 1200}},
+      {"type": "Stop", "name": "C", "latitude": 55.58, "longitude": 37.21,
+       "road_distances": {"D": 900}},
+      {"type": "Stop", "name": "D", "latitude": 55.57, "longitude": 37.22,
+       "road_distances": {}}]})");
+  const string snapshotPath = "transport_snapshot_corrupted.bin";
+  makeBase(input, snapshotPath);
+  string bytes;
+  {
+    ifstream file(snapshotPath, ios::binary);
+    bytes.assign(istreambuf_iterator<char>(file), {});
   }
-  const auto respones = processJson(input);
-  PrintResponses(respones);
+  auto loads = [&](const string& corrupted) {
+    {
+      ofstream file(snapshotPath, ios::binary);
+      file << corrupted;
+    }
+    try {
+      SnapshotReader reader(snapshotPath);
+      BusManager::load(reader);
+      return true;
+    } catch (const exception&) {
+      return false;
+    }
+  };
+  ASSERT(loads(bytes));
+
+  // The route block is the 16-byte run of stop ids 0, 1, 2, 3
+  const uint64_t routeBytes = 16;
+  const uint32_t route[] = {0, 1, 2, 3};
+  string routeBlock(reinterpret_cast<const char*>(&routeBytes), 8);
+  routeBlock.append(reinterpret_cast<const char*>(route), sizeof(route));
+  const size_t routePos = bytes.find(routeBlock);
+  ASSERT(routePos != string::npos);
+  string corrupted = bytes;
+  corrupted[routePos + 8 + 2 * 4] = 100;
+  ASSERT(!loads(corrupted));
+
+  // Any single word overwritten either loads or throws, never reads past
+  // the arrays it indexes
+  size_t rejected = 0;
+  for (size_t pos = 16; pos + 4 <= bytes.size(); pos += 4) {
+    corrupted = bytes;
+    corrupted.replace(pos, 4, "\xff\xff\xff\x7f");
+    rejected += !loads(corrupted);
+  }
+  ASSERT(rejected > 0);
+  remove(snapshotPath.c_str());
+}
+
+void TestStopGeometry() {
+  StopGeometry geometry;
+  geometry.resize(3);
+  geometry.set(0, 55.611087, 37.20829);
+  geometry.set(1, 55.595884, 37.209755);
+  geometry.set(2, 55.632761, 37.333324);
+
+  ASSERT_EQUAL(geometry.measureRoute({0}), 0);
+  const double forward = geometry.measureRoute({0, 1, 2});
+  const double backward = geometry.measureRoute({2, 1, 0});
+  ASSERT(abs(forward - backward) < 1e-6);
+  ASSERT(abs(forward - 10469.7) < 0.1);
+
+  const size_t stopCount = 100000;
+  geometry.resize(stopCount);
+  for (StopId i = 0; i < stopCount; ++i)
+    geometry.set(i, 55 + i % 1000 * 1e-4, 37 + i / 1000 * 1e-4);
+  vector<StopId> route(40);
+  double total = 0;
+  {
+    LOG_DURATION("Great-circle length of 50000 routes");
+    for (StopId bus = 0; bus < 50000; ++bus) {
+      for (StopId i = 0; i < route.size(); ++i)
+        route[i] = (bus * 31 + i * 997) % stopCount;
+      total += geometry.measureRoute(route);
+    }
+  }
+  ASSERT(total > 0);
+}
+
+void TestLongRoutesSpeed() {
+  const int stopCount = 10000;
+  BusManager manager;
+  for (int i = 0; i < stopCount; ++i) {
+    Stop stop("Stop " + to_string(i), 55 + i * 1e-5, 37);
+    stop.addDistance("Stop " + to_string((i + 1) % stopCount), 100);
+    manager.addStop(stop);
+  }
+
+  {
+    LOG_DURATION("Build and finalize 50 buses of 10000 stops");
+    for (int bus = 0; bus < 50; ++bus) {
+      Bus route;
+      route.setNumber(to_string(bus));
+      for (int i = 0; i <= stopCount; ++i)
+        route.addStop((bus + i) % stopCount);
+      manager.addBus(route);
+    }
+    manager.finalize();
+  }
+
+  const BusStats stats = manager.getBusStats(7);
+  ASSERT_EQUAL(stats.stopCount, 10001u);
+  ASSERT_EQUAL(stats.uniqueStopCount, stopCount);
+  ASSERT_EQUAL(stats.routeLength, 1000000);
+}
+
+void TestPassingBuses() {
+  BusManager manager;
+  manager.addStop(Stop("Hub", 55.6, 37.2));
+  const StopId hub = manager.internStop("Hub");
+  for (const string name : {"828", "256", "47", "256"}) {
+    Bus bus;
+    bus.setNumber(name);
+    bus.addStop(hub);
+    bus.addStop(hub);
+    manager.addBus(bus);
+  }
+
+  const string expected =
+      "{\n\"request_id\": 1,\n\"buses\": [\n\"256\",\n\"47\",\n\"828\"\n]\n}";
+  for (const bool finalized : {false, true}) {
+    if (finalized)
+      manager.finalize();
+    ostringstream output;
+    {
+      ResponseWriter writer(&output);
+      manager.writeStopInfo(writer, "Hub", 1);
+    }
+    ASSERT_EQUAL(output.str(), expected);
+  }
+}
+
+string MakeStopLine(int stop, double latitude, int nextStop, int distance) {
+  ostringstream out;
+  out << "{\"type\": \"Stop\", \"name\": \"Stop " << stop
+      << "\", \"latitude\": " << latitude << ", \"longitude\": 37"
+      << ", \"road_distances\": {\"Stop " << nextStop << "\": " << distance
+      << "}}\n";
+  return out.str();
+}
+
+string MakeBusLine(int bus, const vector<int>& stops) {
+  ostringstream out;
+  out << "{\"type\": \"Bus\", \"name\": \"" << bus
+      << "\", \"is_roundtrip\": " << (bus % 2 ? "true" : "false")
+      << ", \"stops\": [";
+  for (size_t i = 0; i < stops.size(); ++i)
+    out << (i ? ", " : "") << "\"Stop " << stops[i] << '"';
+  out << "]}\n";
+  return out.str();
+}
+
+void TestIncrementalUpdates() {
+  const int stopCount = 200;
+  string base =
+      R"({"routing_settings": {"bus_wait_time": 6, "bus_velocity": 40}})"
+      "\n";
+  for (int i = 0; i < stopCount; ++i)
+    base += MakeStopLine(i, 55 + i * 1e-3, (i + 1) % stopCount, 500 + i);
+  for (int bus = 0; bus < 40; ++bus) {
+    vector<int> stops;
+    for (int i = 0; i < 15; ++i)
+      stops.push_back((bus * 5 + i) % stopCount);
+    if (bus % 2)
+      stops.push_back(stops.front());
+    base += MakeBusLine(bus, stops);
+  }
+
+  string updates;
+  for (int i = 0; i < 10; ++i)
+    updates += MakeStopLine(i * 17, 55.5 + i * 1e-3, i * 3, 900 + i);
+  updates += MakeStopLine(stopCount, 55.2, 0, 300);
+  updates += MakeBusLine(7, {0, 1, 2});
+  updates += MakeBusLine(100, {stopCount, 0, 17, 34});
+
+  string queries;
+  for (int i = 0; i < 45; ++i)
+    queries += R"({"id": 1, "type": "Bus", "name": ")" + to_string(i) +
+               "\"}\n";
+  queries += R"({"id": 2, "type": "Bus", "name": "100"})" "\n";
+  for (int i = 0; i < stopCount + 2; i += 3)
+    queries += R"({"id": 3, "type": "Stop", "name": "Stop )" + to_string(i) +
+               "\"}\n";
+  for (int i = 0; i < 20; ++i)
+    queries += R"({"id": 4, "type": "Route", "from": "Stop )" +
+               to_string(i * 13 % stopCount) + R"(", "to": "Stop )" +
+               to_string(i * 29 % (stopCount + 1)) + "\"}\n";
+
+  ostringstream expected;
+  {
+    istringstream input(base + updates + queries + "not json\n");
+    serveJsonLines(input, expected);
+  }
+  ostringstream updated;
+  {
+    istringstream input(base + queries + updates + queries + "not json\n");
+    serveJsonLines(input, updated);
+  }
+  // The answers given after the updates match a service that saw the final
+  // base up front
+  const string& text = updated.str();
+  const size_t prefixSize = text.size() - expected.str().size();
+  ASSERT_EQUAL(text.substr(prefixSize), expected.str());
+  ASSERT(text.substr(0, prefixSize) != expected.str());
+  ASSERT(text.rfind("{\"error_message\": ") != string::npos);
+
+  // Error messages are quoted like any other string, so every line parses.
+  // A bad base request is reported before the answer that follows it.
+  stringstream errors;
+  {
+    istringstream input(R"({"type": "Stop", "name": "\u12"})" "\n"
+                        R"({"type": "Stop", "name": "A"})" "\n"
+                        R"({"id": 1, "type": "Stop", "name": "A"})" "\n");
+    serveJsonLines(input, errors);
+  }
+  vector<string> messages;
+  for (string line; getline(errors, line);) {
+    const auto document = Json::Load(vector<char>(begin(line), end(line)));
+    messages.emplace_back(
+        document.GetRoot().AsMap().at("error_message").AsString());
+  }
+  ASSERT_EQUAL(messages.size(), 3u);
+  ASSERT(messages[0].find("\\u") != string::npos);
+  ASSERT(messages[1].find("road_distances") != string::npos);
+  ASSERT_EQUAL(messages[2], "not found");
+
+  FeedParams params;
+  params.stopCount = 10000;
+  params.busCount = 2000;
+  params.busRequests = 0;
+  params.stopRequests = 0;
+  params.hasRoutingSettings = false;
+  const string synthetic = GenerateFeed(params);
+  BusManager manager = readBusManagerFromJson(
+      Json::Load(vector<char>(begin(synthetic), end(synthetic))).GetRoot());
+  {
+    LOG_DURATION("100 stop updates on 10000 stops and 2000 buses");
+    for (int i = 0; i < 100; ++i) {
+      Stop stop("Stop " + to_string(i * 97), 55.5, 37.5);
+      stop.addDistance("Stop " + to_string(i * 97 + 1), 1000);
+      manager.addStop(stop);
+      manager.finalize();
+      ASSERT(manager.getBusStats(i).routeLength > 0);
+    }
+  }
+}
+
+void TestVersionedReads() {
+  auto makeStop = [](double distance) {
+    Stop stop("A", 55.611087, 37.20829);
+    stop.addDistance("B", distance);
+    return stop;
+  };
+  BusManager initial;
+  initial.addStop(makeStop(1000));
+  initial.addStop(Stop("B", 55.595884, 37.209755));
+  Bus bus;
+  bus.setNumber("750").setIsCircle(true);
+  bus.addStop(initial.internStop("A"));
+  bus.addStop(initial.internStop("B"));
+  initial.addBus(bus);
+  VersionedBusManager versions(move(initial));
+
+  // Every version a reader sees is whole: the way there and back have the
+  // same length
+  const int updateCount = 200;
+  atomic<bool> isUpdating = true;
+  auto reader = [&] {
+    size_t reads = 0;
+    for (double last = 0; isUpdating || reads == 0; ++reads) {
+      const auto version = versions.read();
+      const double length = version->getBusStats(0).routeLength;
+      ASSERT(length >= last);
+      ASSERT_EQUAL(static_cast<long>(length) % 2000, 0);
+      ASSERT_EQUAL(versions.read()->getBusStats(0).stopCount, 3u);
+      last = length;
+    }
+    return reads;
+  };
+
+  vector<future<size_t>> readers;
+  for (int i = 0; i < 3; ++i)
+    readers.push_back(async(launch::async, reader));
+  {
+    LOG_DURATION("200 published updates under 3 readers");
+    for (int i = 2; i <= updateCount; ++i)
+      versions.update([&makeStop, i](BusManager& manager) {
+        manager.addStop(makeStop(i * 1000));
+      });
+  }
+  isUpdating = false;
+  for (auto& r : readers)
+    ASSERT(r.get() > 0);
+
+  ASSERT_EQUAL(versions.read()->getBusStats(0).routeLength,
+               2000 * updateCount);
+  versions.collectRetired();
+  ASSERT_EQUAL(versions.getRetiredCount(), 0u);
+
+  // Readers only release their version; freeing it is left to the writer
+  {
+    const auto version = versions.read();
+    versions.update([](BusManager&) {});
+    ASSERT_EQUAL(versions.getRetiredCount(), 1u);
+  }
+  ASSERT_EQUAL(versions.getRetiredCount(), 1u);
+  versions.collectRetired();
+  ASSERT_EQUAL(versions.getRetiredCount(), 0u);
+}
+
+void TestFeedGenerator() {
+  FeedParams params;
+  params.stopCount = 500;
+  params.busCount = 80;
+  params.unknownNamePercent = 0;
+
+  ostringstream first;
+  generateFeed(params, first);
+  ostringstream second;
+  generateFeed(params, second);
+  ASSERT(first.str() == second.str());
+  ++params.seed;
+  ostringstream reseeded;
+  generateFeed(params, reseeded);
+  ASSERT(first.str() != reseeded.str());
+
+  // Every name a request asks for exists and road distances outgrow straight
+  // ones
+  const string text = first.str();
+  const auto document = Json::Load(vector<char>(begin(text), end(text)));
+  const auto& root = document.GetRoot();
+  ASSERT_EQUAL(root.AsMap().at("stat_requests").AsArray().size(), 2000u);
+  const BusManager manager = readBusManagerFromJson(root);
+  ostringstream output;
+  {
+    ResponseWriter writer(&output);
+    processRequestsFromJson(manager, root, writer);
+  }
+  ASSERT_EQUAL(output.str().find("not found"), string::npos);
+  for (BusId bus = 0; bus < params.busCount; ++bus)
+    ASSERT(manager.getBusStats(bus).curvature > 1);
+
+  // Walks off a ragged grid never stay at the same stop
+  params.stopCount = 7;
+  ostringstream small;
+  generateFeed(params, small);
+  const string smallText = small.str();
+  const auto smallDocument =
+      Json::Load(vector<char>(begin(smallText), end(smallText)));
+  for (const auto& request :
+       smallDocument.GetRoot().AsMap().at("base_requests").AsArray()) {
+    const auto& requestMap = request.AsMap();
+    if (requestMap.at("type").AsString() != "Bus")
+      continue;
+    const auto& stops = requestMap.at("stops").AsArray();
+    for (size_t i = 0; i + 1 < stops.size(); ++i)
+      ASSERT(stops[i].AsString() != stops[i + 1].AsString());
+  }
+}
+
+void TestSpatialIndex() {
+  const size_t stopCount = 100000;
+  auto latitudeOf = [](StopId stop) {
+    return 55 + (stop * 7919 % 100003) * 1e-5;
+  };
+  auto longitudeOf = [](StopId stop) {
+    return 37 + (stop * 104729 % 100019) * 1e-5;
+  };
+  SpatialIndex index;
+  StopGeometry geometry;
+  geometry.resize(stopCount + 1);
+  for (StopId i = 0; i < stopCount; ++i) {
+    index.add(i, latitudeOf(i), longitudeOf(i));
+    geometry.set(i, latitudeOf(i), longitudeOf(i));
+  }
+  {
+    LOG_DURATION("Build a spatial index over 100000 stops");
+    index.build();
+  }
+
+  // Matches a linear scan over great-circle distances
+  for (int query = 0; query < 20; ++query) {
+    const double latitude = 55 + query * 0.05;
+    const double longitude = 37.5 + (query % 3) * 0.3;
+    geometry.set(stopCount, latitude, longitude);
+    vector<double> distances;
+    for (StopId i = 0; i < stopCount; ++i)
+      distances.push_back(geometry.measureRoute({stopCount, i}));
+    sort(begin(distances), end(distances));
+
+    const auto nearest = index.findNearest(latitude, longitude, 15);
+    ASSERT_EQUAL(nearest.size(), 15u);
+    for (size_t i = 0; i < nearest.size(); ++i)
+      ASSERT(abs(nearest[i].second - distances[i]) < 1e-3);
+
+    const double radius = 300 + query * 20;
+    const auto within = index.findWithin(latitude, longitude, radius);
+    const size_t expected =
+        lower_bound(begin(distances), end(distances), radius) -
+        begin(distances);
+    ASSERT(abs(static_cast<int>(within.size() - expected)) <= 1);
+    for (size_t i = 0; i < within.size(); ++i)
+      ASSERT(abs(within[i].second - distances[i]) < 1e-3);
+  }
+
+  size_t found = 0;
+  {
+    LOG_DURATION("100000 nearest-5 queries over 100000 stops");
+    for (int query = 0; query < 100000; ++query)
+      found += index.findNearest(55 + query % 997 * 1e-3,
+                                 37 + query % 991 * 1e-3, 5)
+                   .size();
+  }
+  ASSERT_EQUAL(found, 500000u);
+
+  // Moved and added stops are found as if the index was built from scratch
+  SpatialIndex rebuilt;
+  for (StopId i = 0; i <= stopCount; ++i) {
+    if (i % 1000 != 0 && i != stopCount) {
+      rebuilt.add(i, latitudeOf(i), longitudeOf(i));
+      continue;
+    }
+    rebuilt.add(i, 55.5 + i * 1e-8, 37.5);
+    index.update(i, 55.5 + i * 1e-8, 37.5);
+  }
+  rebuilt.build();
+  ASSERT_EQUAL(index.size(), stopCount + 1);
+  for (const double radius : {1.0, 500.0})
+    ASSERT(index.findWithin(55.5, 37.5, radius) ==
+           rebuilt.findWithin(55.5, 37.5, radius));
+  ASSERT(index.findNearest(55.5, 37.5, 150) ==
+         rebuilt.findNearest(55.5, 37.5, 150));
+
+  FeedParams params;
+  params.nearbyRequests = 500;
+  ostringstream feed;
+  generateFeed(params, feed);
+  ostringstream expected;
+  {
+    istringstream input(feed.str());
+    processJson(input, expected);
+  }
+  ostringstream streamed;
+  {
+    istringstream input(feed.str());
+    processJsonStream(input, streamed);
+  }
+  ASSERT(expected.str().find("\"distance\": ") != string::npos);
+  ASSERT(streamed.str() == expected.str());
+}
+
+void TestCompactStops() {
+  ASSERT(sizeof(StopInfo) <= 12);
+
+  const StopPosition position = StopPosition::fromDegrees(55.6110871, -37.2);
+  ASSERT(abs(position.getLatitude() - 55.6110871) < 1e-9);
+  ASSERT(abs(position.getLongitude() + 37.2) < 1e-9);
+
+  StringInterner names;
+  size_t mismatches = 0;
+  {
+    LOG_DURATION("Intern 1000000 names");
+    for (uint32_t i = 0; i < 1000000; ++i)
+      mismatches += names.intern("Stop " + to_string(i % 500000)) != i % 500000;
+  }
+  ASSERT_EQUAL(mismatches, 0u);
+  ASSERT_EQUAL(names.size(), 500000u);
+  ASSERT_EQUAL(names.getName(123456), "Stop 123456");
+  ASSERT_EQUAL(*names.find("Stop 499999"), 499999u);
+  ASSERT(!names.find("Stop 500000"));
+  ASSERT_EQUAL(names.intern(""), 500000u);
+  ASSERT_EQUAL(names.getName(500000), "");
+
+  StringInterner copy = names;
+  copy.intern(string(100000, 'x'));
+  ASSERT_EQUAL(copy.size(), names.size() + 1);
+  ASSERT_EQUAL(*copy.find(string(100000, 'x')), 500001u);
+  ASSERT(!names.find(string(100000, 'x')));
+}
+
+void TestMultipleFeeds() {
+  const string first = R"({"base_requests": [
+      {"type": "Stop", "name": "X", "latitude": 55.6, "longitude": 37.2,
+       "road_distances": {"Y": 1000}},
+      {"type": "Stop", "name": "Y", "latitude": 55.61, "longitude": 37.21,
+       "road_distances": {}},
+      {"type": "Bus", "name": "1", "is_roundtrip": false, "stops": ["X", "Y"]}
+  ]})";
+  const string second = R"({"memory_budget": 1000000, "base_requests": [
+      {"type": "Stop", "name": "X", "latitude": 55.7, "longitude": 37.3,
+       "road_distances": {"Z": 700}},
+      {"type": "Stop", "name": "Z", "latitude": 55.71, "longitude": 37.31,
+       "road_distances": {"X": 500}},
+      {"type": "Bus", "name": "1", "is_roundtrip": true,
+       "stops": ["X", "Z", "X"]}
+  ]})";
+  const string statRequests = R"("stat_requests": [
+      {"id": 1, "type": "Bus", "name": "1", "feed": "first"},
+      {"id": 2, "type": "Bus", "name": "1", "feed": "second"},
+      {"id": 3, "type": "Stop", "name": "Y", "feed": "first"},
+      {"id": 4, "type": "Stop", "name": "Y", "feed": "second"},
+      {"id": 5, "type": "Stop", "name": "X", "feed": "third"}
+  ])";
+
+  // Each feed answers as it would on its own
+  auto answer = [](const string& document) {
+    istringstream input(document);
+    ostringstream output;
+    processJson(input, output);
+    return output.str();
+  };
+  const string expected = answer(
+      first.substr(0, first.size() - 1) + R"(, "stat_requests": [
+      {"id": 1, "type": "Bus", "name": "1"},
+      {"id": 2, "type": "Bus", "name": "1"},
+      {"id": 3, "type": "Stop", "name": "Y"}]})");
+  const string expectedSecond = answer(
+      second.substr(0, second.size() - 1) + R"(, "stat_requests": [
+      {"id": 2, "type": "Bus", "name": "1"},
+      {"id": 4, "type": "Stop", "name": "Y"}]})");
+  const string hosted =
+      answer(R"({"feeds": {"first": )" + first + R"(, "second": )" + second +
+             R"(, "third": {"memory_budget": 100, )" + first.substr(1) +
+             "}, " + statRequests + "}");
+
+  auto response = [](const string& output, int id) {
+    const string head = "{\n\"request_id\": " + to_string(id) + ",";
+    const size_t begin = output.find(head);
+    return begin == string::npos
+               ? string()
+               : output.substr(begin, output.find("\n}", begin) - begin);
+  };
+  ASSERT_EQUAL(response(hosted, 1), response(expected, 1));
+  ASSERT_EQUAL(response(hosted, 2), response(expectedSecond, 2));
+  ASSERT(response(hosted, 2) != response(expected, 2));
+  ASSERT_EQUAL(response(hosted, 3), response(expected, 3));
+  ASSERT_EQUAL(response(hosted, 4), response(expectedSecond, 4));
+  ASSERT_EQUAL(response(hosted, 5),
+               "{\n\"request_id\": 5,\n\"error_message\": \"not found\"");
+  ASSERT(hosted.find("request_id\": 1,") < hosted.find("request_id\": 2,"));
+  ASSERT(hosted.find("request_id\": 4,") < hosted.find("request_id\": 5,"));
+
+  // Names repeated across feeds are stored once
+  FeedHost host;
+  auto load = [&host](const string& document) {
+    istringstream input(document);
+    return readBusManagerFromJson(Json::Load(input).GetRoot(),
+                                  host.getNames());
+  };
+  host.addFeed("first", load(first));
+  const size_t poolBytes = host.getNames()->getMemoryUsage();
+  host.addFeed("second", load(second));
+  ASSERT(host.getNames()->getMemoryUsage() - poolBytes < poolBytes);
+  ASSERT_EQUAL(host.getFeedCount(), 2u);
+  ASSERT(host.findFeed("second"));
+  ASSERT(!host.findFeed("third"));
+
+  bool isOverBudget = false;
+  try {
+    host.addFeed("third", load(first), 100);
+  } catch (const length_error&) {
+    isOverBudget = true;
+  }
+  ASSERT(isOverBudget);
+  ASSERT(!host.findFeed("third"));
+
+  // Budgets are checked against an estimate before building, which never
+  // exceeds the real size
+  FeedParams params;
+  params.stopCount = 2000;
+  params.busCount = 300;
+  params.busRequests = 0;
+  params.stopRequests = 0;
+  const string synthetic = GenerateFeed(params);
+  for (const string& document : {first, second, synthetic}) {
+    istringstream input(document);
+    const auto parsed = Json::Load(input);
+    const size_t estimate = BusManager::estimateMemoryUsage(parsed.GetRoot());
+    ASSERT(estimate > 100);
+    ASSERT(estimate <= readBusManagerFromJson(parsed.GetRoot())
+                           .getMemoryUsage());
+  }
+}
+
+void TestMetrics() {
+  Metrics::reset();
+  int evaluations = 0;
+  METRICS_GAUGE(STOPS, ++evaluations);
+
+#ifndef TRANSPORT_METRICS
+  ASSERT_EQUAL(evaluations, 0);
+  ostringstream empty;
+  Metrics::dump(empty);
+  ASSERT(empty.str().empty());
+#else
+  ASSERT_EQUAL(evaluations, 1);
+
+  // Two threads record 1..1000 us each
+  auto recordAll = [] {
+    for (int i = 1; i <= 1000; ++i)
+      Metrics::record(Metrics::Timer::ROUTE_REQUEST, chrono::microseconds(i));
+  };
+  thread other(recordAll);
+  recordAll();
+  other.join();
+
+  istringstream input(R"({"base_requests": [
+      {"type": "Stop", "name": "X", "latitude": 55.6, "longitude": 37.2,
+       "road_distances": {}},
+      {"type": "Bus", "name": "1", "is_roundtrip": false, "stops": ["X"]}],
+    "stat_requests": [{"id": 1, "type": "Bus", "name": "1"},
+                      {"id": 2, "type": "Bus", "name": "2"},
+                      {"id": 3, "type": "Stop", "name": "X"},
+                      {"id": 4, "type": "Unknown"}]})");
+  ostringstream output;
+  processJson(input, output, 1);
+
+  ostringstream dump;
+  Metrics::dump(dump);
+  istringstream dumpInput(dump.str());
+  const auto document = Json::Load(dumpInput);
+  const auto& metrics = document.GetRoot().AsMap();
+
+  const auto& counters = metrics.at("counters").AsMap();
+  ASSERT_EQUAL(counters.at("base_stops").AsInt(), 1);
+  ASSERT_EQUAL(counters.at("base_buses").AsInt(), 1);
+  ASSERT_EQUAL(counters.at("not_found").AsInt(), 1);
+  ASSERT_EQUAL(counters.at("unknown_type").AsInt(), 1);
+
+  const auto& gauges = metrics.at("gauges").AsMap();
+  ASSERT_EQUAL(gauges.at("stops").AsInt(), 1);
+  ASSERT_EQUAL(gauges.at("buses").AsInt(), 1);
+  ASSERT(gauges.at("model_bytes").AsDouble() > 0);
+
+  const auto& latencies = metrics.at("latency_ns").AsMap();
+  ASSERT_EQUAL(latencies.at("parse").AsMap().at("count").AsInt(), 1);
+  ASSERT_EQUAL(latencies.at("bus_request").AsMap().at("count").AsInt(), 2);
+  ASSERT_EQUAL(latencies.at("stop_request").AsMap().at("count").AsInt(), 1);
+
+  const auto& routes = latencies.at("route_request").AsMap();
+  ASSERT_EQUAL(routes.at("count").AsInt(), 2000);
+  ASSERT_EQUAL(routes.at("max").AsDouble(), 1e6);
+  for (const auto& [quantile, expected] :
+       {pair{"p50", 500e3}, {"p90", 900e3}, {"p99", 990e3}}) {
+    const double value = routes.at(quantile).AsDouble();
+    ASSERT(value >= expected && value <= expected * 17 / 16);
+  }
+#endif
+}
+
+void TestZeroAllocationQueries() {
+  // Array, aligned and nothrow allocations are counted like plain ones
+  {
+    struct alignas(64) Wide {
+      char bytes[64];
+    };
+    const size_t before = getAllocationCount();
+    auto numbers = make_unique<int[]>(4);
+    auto wide = make_unique<Wide>();
+    auto wides = make_unique<Wide[]>(2);
+    unique_ptr<int> quiet(new (nothrow) int(1));
+    const size_t allocations = getAllocationCount() - before;
+    ASSERT_EQUAL(allocations, 4u);
+    ASSERT(reinterpret_cast<uintptr_t>(wides.get()) % alignof(Wide) == 0);
+  }
+
+  // Names too long for the small string optimization
+  auto makeInput = [](FeedParams params) {
+    params.stopCount = 1000;
+    params.busCount = 200;
+    string text = GenerateFeed(params);
+    for (size_t i = text.find("Stop "); i != string::npos;
+         i = text.find("Stop ", i + 1))
+      text.replace(i, 4, "Stop with a long name");
+    return text;
+  };
+  // Routes over Dijkstra and nearby stops on top of the Bus and Stop requests
+  FeedParams params;
+  params.busRequests = 10000;
+  params.stopRequests = 10000;
+  params.routeRequests = 1000;
+  params.nearbyRequests = 1000;
+  const string text = makeInput(params);
+  const auto document = Json::Load(vector<char>(begin(text), end(text)));
+  const auto& requests = document.GetRoot().AsMap().at("stat_requests");
+  const BusManager manager = readBusManagerFromJson(document.GetRoot());
+
+  // Output goes nowhere; the writer keeps its buffer between flushes
+  ostream sink(nullptr);
+  ResponseWriter writer(&sink);
+  for (const auto& request : requests.AsArray())
+    processRequest(manager, request, writer);
+
+  const size_t before = getAllocationCount();
+  for (const auto& request : requests.AsArray())
+    processRequest(manager, request, writer);
+  // Counted before ASSERT_EQUAL builds its message
+  const size_t allocations = getAllocationCount() - before;
+  ASSERT_EQUAL(allocations, 0u);
+
+  // The streaming reader allocates for the base and for the first requests
+  // only, however many stat requests follow
+  auto countStreamed = [](const string& input) {
+    istringstream stream(input);
+    ostream streamSink(nullptr);
+    const size_t before = getAllocationCount();
+    processJsonStream(stream, streamSink);
+    return getAllocationCount() - before;
+  };
+  params.routeRequests = 0;
+  params.nearbyRequests = 0;
+  params.hasRoutingSettings = false;
+  const size_t streamed = countStreamed(makeInput(params));
+  params.busRequests *= 2;
+  params.stopRequests *= 2;
+  const size_t streamedLonger = countStreamed(makeInput(params));
+  ASSERT_EQUAL(streamedLonger, streamed);
 }
 
 }  // namespace
@@ -25,6 +1085,30 @@ namespace TransportTests {
 void RunTests() {
   TestRunner tr;
   RUN_TEST(tr, TestJsonParser);
+  RUN_TEST(tr, TestJsonLoad);
+  RUN_TEST(tr, TestStringInterner);
+  RUN_TEST(tr, TestBusStatsCache);
+  RUN_TEST(tr, TestRoadDistances);
+  RUN_TEST(tr, TestParallelSpeedup);
+  RUN_TEST(tr, TestStreamingMatchesDom);
+  RUN_TEST(tr, TestResponseWriter);
+  RUN_TEST(tr, TestQuotedNamesRoundTrip);
+  RUN_TEST(tr, TestRouter);
+  RUN_TEST(tr, TestRouterLongRoute);
+  RUN_TEST(tr, TestRouterSpeed);
+  RUN_TEST(tr, TestSnapshotRoundTrip);
+  RUN_TEST(tr, TestCorruptedSnapshot);
+  RUN_TEST(tr, TestStopGeometry);
+  RUN_TEST(tr, TestLongRoutesSpeed);
+  RUN_TEST(tr, TestPassingBuses);
+  RUN_TEST(tr, TestIncrementalUpdates);
+  RUN_TEST(tr, TestVersionedReads);
+  RUN_TEST(tr, TestFeedGenerator);
+  RUN_TEST(tr, TestSpatialIndex);
+  RUN_TEST(tr, TestCompactStops);
+  RUN_TEST(tr, TestMultipleFeeds);
+  RUN_TEST(tr, TestMetrics);
+  RUN_TEST(tr, TestZeroAllocationQueries);
 }
 
 }  // namespace TransportTests
\ No newline at end of file
@@ -1,38 +1,27 @@
 #include "transport.h"
+#include "feeds.h"
 #include "json.h"
-//#include "tests.h"
+#include "memory.h"
+#include "metrics.h"
+#include "versioned_manager.h"
 
 #include <algorithm>
-#include <cmath>
+#include <atomic>
 #include <exception>
+#include <fstream>
+#include <future>
 #include <iomanip>
 #include <memory>
+#include <numeric>
 #include <sstream>
+#include <thread>
 
 using namespace std;
 
 namespace {
 
-const double PI = 3.1415926535;
-const int EARTH_R = 6371;
-
-double degToRad(double deg) {
-  return deg * (PI / 180);
-}
-
-double calculStraightDist(const Stop& lhs, const Stop& rhs) {
-  return acos(sin(degToRad(lhs.getLat())) * sin(degToRad(rhs.getLat())) +
-              cos(degToRad(lhs.getLat())) * cos(degToRad(rhs.getLat())) *
-                  cos(abs(degToRad(lhs.getLon() - rhs.getLon())))) *
-         6371000;
-}
-
-double calculGivenDist(const Stop& lhs, const Stop& rhs) {
-  auto distance = lhs.getDistance(rhs.getName());
-  if (!distance)
-    distance = rhs.getDistance(lhs.getName());
-  return *distance;
-}
+const size_t MIN_BUSES_PER_FINALIZE_TASK = 1024;
+const size_t STAT_REQUESTS_BLOCK = 1024;
 
 string_view trim(string_view str, const std::string& whitespace = " \t") {
   const auto strBegin = str.find_first_not_of(whitespace);
@@ -90,50 +79,100 @@ Number ReadNumberOnLine(istream& stream) {
 }
 
 template <typename Func>
-double calculateRouteDist(const Bus& bus,
-                          const SoptsInfo& stopsInfo,
-                          Func calculateFunc) {
+double calculateRouteDist(const Bus& bus, Func calculateFunc) {
   const auto& stops = bus.getStops();
   double dist = 0;
 
-  for (int i = 0; i < stops.size() - 1; ++i)
-    dist += calculateFunc(stopsInfo.at(stops[i]).stop,
-                          stopsInfo.at(stops[i + 1]).stop);
+  for (size_t i = 0; i + 1 < stops.size(); ++i)
+    dist += calculateFunc(stops[i], stops[i + 1]);
 
   if (bus.getIsCircle())
-    for (int i = stops.size() - 1; i > 0; --i)
-      dist += calculateFunc(stopsInfo.at(stops[i]).stop,
-                            stopsInfo.at(stops[i - 1]).stop);
+    for (size_t i = stops.size() - 1; i > 0; --i)
+      dist += calculateFunc(stops[i], stops[i - 1]);
 
   return dist;
 }
 
-Bus toBus(const std::map<std::string, Json::Node>& busMap) {
+// Stamps the stops of a route with a fresh epoch in a per-thread array over
+// stop ids: a stop is seen for the first time iff its stamp is stale.
+int countUniqueStops(const vector<StopId>& stops, size_t stopCount) {
+  thread_local vector<uint32_t> stamps;
+  thread_local uint32_t epoch = 0;
+  if (stamps.size() < stopCount)
+    stamps.resize(stopCount, 0);
+  if (++epoch == 0) {
+    fill(begin(stamps), end(stamps), 0);
+    epoch = 1;
+  }
+
+  int uniqueStops = 0;
+  for (const StopId stop : stops)
+    if (stamps[stop] != epoch) {
+      stamps[stop] = epoch;
+      ++uniqueStops;
+    }
+  return uniqueStops;
+}
+
+Bus toBus(const Json::Dict& busMap, BusManager& manager) {
   Bus bus;
-  bus.setNumber(busMap.at("name").AsString());
+  bus.setNumber(string(busMap.at("name").AsString()));
   bus.setIsCircle(!busMap.at("is_roundtrip").AsBool());
-  const auto stops = busMap.at("stops").AsArray();
-  for (const auto& stop : stops)
-    bus.addStop(stop.AsString());
+  for (const auto& stop : busMap.at("stops").AsArray())
+    bus.addStop(manager.internStop(stop.AsString()));
   return bus;
 }
 
-Stop toStop(const std::map<std::string, Json::Node>& stopMap) {
-  Stop stop(stopMap.at("name").AsString(), stopMap.at("latitude").AsDouble(),
-            stopMap.at("longitude").AsDouble());
+// Names are interned straight from the document
+void addStopRequest(const Json::Dict& stopMap, BusManager& manager) {
+  const string_view name = stopMap.at("name").AsString();
+  manager.internStop(name);
+
   const auto& roadDistances = stopMap.at("road_distances").AsMap();
-  for (const auto& [name, distance] : roadDistances)
-    stop.addDistance(name, distance.AsInt());
+  vector<pair<StopId, double>> distances;
+  distances.reserve(roadDistances.size());
+  for (const auto& [other, distance] : roadDistances)
+    distances.emplace_back(manager.internStop(other), distance.AsInt());
 
-  return stop;
+  manager.addStop(name, stopMap.at("latitude").AsDouble(),
+                  stopMap.at("longitude").AsDouble(), move(distances));
+}
+
+RoutingSettings toRoutingSettings(const Json::Dict& settingsMap) {
+  RoutingSettings settings;
+  settings.busWaitTime = settingsMap.at("bus_wait_time").AsDouble();
+  settings.busVelocity = settingsMap.at("bus_velocity").AsDouble();
+  return settings;
+}
+
+optional<size_t> toNearbyCount(const Json::Node* count) {
+  if (!count)
+    return nullopt;
+  return max(count->AsInt(), 0);
+}
+
+optional<double> toNearbyRadius(const Json::Node* radius) {
+  if (!radius)
+    return nullopt;
+  return radius->AsDouble();
+}
+
+void addBaseRequest(const Json::Dict& requestMap, BusManager& manager) {
+  const string_view type = requestMap.at("type").AsString();
+  if (type == "Bus")
+    manager.addBus(toBus(requestMap, manager));
+  else if (type == "Stop")
+    addStopRequest(requestMap, manager);
+  else
+    throw std::runtime_error("Invalid requst type");
 }
 
 }  // namespace
 
 Stop::Stop(string name, double lat, double lon)
-    : name_(name), lat_(lat), lon_(lon) {}
+    : name_(move(name)), lat_(lat), lon_(lon) {}
 
-string Stop::getName() const {
+const string& Stop::getName() const {
   return name_;
 }
 double Stop::getLat() const {
@@ -143,28 +182,22 @@ double Stop::getLon() const {
   return lon_;
 }
 
-optional<double> Stop::getDistance(const string& stopName) const {
-  if (distanceToOtherStops.find(stopName) == end(distanceToOtherStops))
-    return nullopt;
-  else {
-    return distanceToOtherStops.at(stopName);
-  }
+const vector<pair<string, double>>& Stop::getDistances() const {
+  return distanceToOtherStops;
 }
 
 void Stop::addDistance(const string& otherStopName, double distance) {
-  distanceToOtherStops.insert({otherStopName, distance});
+  distanceToOtherStops.emplace_back(otherStopName, distance);
 }
 
-Bus::Bus() : uniqueStops(0), isCircle_(false) {}
+Bus::Bus() : isCircle_(false) {}
 
-void Bus::addStop(const string& stop) {
-  if (find(begin(stops_), end(stops_), stop) == end(stops_))
-    ++uniqueStops;
+void Bus::addStop(StopId stop) {
   stops_.push_back(stop);
 }
 
 Bus& Bus::setNumber(string number) {
-  number_ = number;
+  number_ = move(number);
   return *this;
 }
 
@@ -173,10 +206,6 @@ Bus& Bus::setIsCircle(bool isCircle) {
   return *this;
 }
 
-double Bus::getUniqueStopsNumber() const {
-  return uniqueStops;
-}
-
 size_t Bus::getStopsNumber() const {
   if (isCircle_)
     return stops_.size() * 2 - 1;
@@ -189,134 +218,923 @@ bool Bus::getIsCircle() const {
   return isCircle_;
 }
 
-string Bus::getNumber() const {
+const string& Bus::getNumber() const {
   return number_;
 }
 
-const vector<string>& Bus::getStops() const {
+const vector<StopId>& Bus::getStops() const {
   return stops_;
 }
 
+BusManager::BusManager() : BusManager(make_shared<NamePool>()) {}
+
+BusManager::BusManager(shared_ptr<NamePool> names)
+    : stopNames(names), busNames(names) {}
+
+StopId BusManager::internStop(string_view stopName) {
+  const StopId id = stopNames.intern(stopName);
+  if (id == allStops.size()) {
+    allStops.emplace_back();
+    passingBuses.emplace_back();
+    geometry.resize(allStops.size());
+  }
+  return id;
+}
+
 void BusManager::addBus(const Bus& bus) {
-  buses.emplace(bus.getNumber(), bus);
-  for (const auto& stop : bus.getStops())
-    allStops[stop].passingBuses.insert(bus.getNumber());
+  METRICS_COUNT(BASE_BUSES);
+  finalized = false;
+  const BusId id = busNames.intern(bus.getNumber());
+  if (id == buses.size()) {
+    buses.push_back(bus);
+    if (isPrepared)
+      staleBuses.push_back(id);
+  }
+  for (const StopId stop : bus.getStops()) {
+    allStops[stop].isKnown = true;
+    passingBuses[stop].push_back(id);
+  }
+  if (isPrepared)
+    staleStops.insert(end(staleStops), begin(bus.getStops()),
+                      end(bus.getStops()));
 }
 
-string BusManager::getBusInfo(const string& busNumber, int requestId) const {
-  ostringstream info;
-  info.precision(6);
-  info << "{" << endl;
-  info << "\"request_id\": " << requestId << ",\n";
-  if (buses.find(busNumber) == end(buses)) {
-    info << "\"error_message\": \"not found\"\n";
-    info << "}";
-    return info.str();
+void BusManager::writeBusInfo(ResponseWriter& writer,
+                              string_view busNumber,
+                              int requestId) const {
+  METRICS_TIMER(BUS_REQUEST);
+  writer.beginResponse().write("{\n\"request_id\": ").writeNumber(requestId);
+  const auto busId = busNames.find(busNumber);
+  if (!busId) {
+    METRICS_COUNT(NOT_FOUND);
+    writer.write(",\n\"error_message\": \"not found\"\n}");
+    return;
   }
 
-  const Bus& bus = buses.at(busNumber);
+  const BusStats stats = getBusStats(*busId);
+
+  writer.write(",\n\"stop_count\": ").writeNumber(stats.stopCount);
+  writer.write(",\n\"unique_stop_count\": ").writeNumber(stats.uniqueStopCount);
+  writer.write(",\n\"route_length\": ").writeNumber(stats.routeLength);
+  writer.write(",\n\"curvature\": ").writeNumber(stats.curvature);
+  writer.write("\n}");
+}
+
+void BusManager::writeStopInfo(ResponseWriter& writer,
+                               string_view stopName,
+                               int requestId) const {
+  METRICS_TIMER(STOP_REQUEST);
+  writer.beginResponse().write("{\n\"request_id\": ").writeNumber(requestId);
+  const auto stopId = findKnownStop(stopName);
+  if (!stopId) {
+    METRICS_COUNT(NOT_FOUND);
+    writer.write(",\n\"error_message\": \"not found\"\n}");
+    return;
+  }
 
-  const double gDist = calculateRouteDist(bus, allStops, calculGivenDist);
-  const double curvature =
-      gDist / calculateRouteDist(bus, allStops, calculStraightDist);
+  writer.write(",\n\"buses\": [\n");
 
-  info << "\"stop_count\": " << bus.getStopsNumber() << ",\n";
-  info << "\"unique_stop_count\": " << bus.getUniqueStopsNumber() << ",\n";
-  info << "\"route_length\": " << gDist << ",\n";
-  info << "\"curvature\": " << curvature << endl;
-  info << "}";
+  vector<BusId> unsortedBuses;
+  const vector<BusId>* buses = &passingBuses[*stopId];
+  if (!finalized) {
+    unsortedBuses = *buses;
+    sortBusesByName(unsortedBuses);
+    buses = &unsortedBuses;
+  }
 
-  return info.str();
+  bool isFirst = true;
+  for (const BusId bus : *buses) {
+    if (!isFirst)
+      writer.write(",\n");
+    else
+      isFirst = false;
+    writer.writeQuoted(busNames.getName(bus));
+  }
+  writer.write("\n]\n}");
 }
 
-string BusManager::getStopInfo(const string& stopName, int requestId) const {
-  ostringstream info;
-  info.precision(6);
-  info << "{" << endl;
-  info << "\"request_id\": " << requestId << ",\n";
-  if (allStops.find(stopName) == end(allStops)) {
-    info << "\"error_message\": \"not found\"\n";
-    info << "}";
-    return info.str();
+void BusManager::writeRouteInfo(ResponseWriter& writer,
+                                string_view fromStop,
+                                string_view toStop,
+                                int requestId) const {
+  if (!finalized)
+    throw logic_error("Routing requires a finalized BusManager");
+  METRICS_TIMER(ROUTE_REQUEST);
+
+  writer.beginResponse().write("{\n\"request_id\": ").writeNumber(requestId);
+  const auto from = findKnownStop(fromStop);
+  const auto to = findKnownStop(toStop);
+  // Reused by the queries of this thread
+  thread_local RouteInfo route;
+  if (!routingSettings || !from || !to ||
+      !router.findRoute(*from, *to, route)) {
+    METRICS_COUNT(NOT_FOUND);
+    writer.write(",\n\"error_message\": \"not found\"\n}");
+    return;
   }
 
-  info << "\"buses\": [\n";
+  writer.write(",\n\"total_time\": ").writeNumber(route.totalTime);
+  writer.write(",\n\"items\": [\n");
+  bool isFirst = true;
+  for (const RouteRide& ride : route.rides) {
+    if (!isFirst)
+      writer.write(",\n");
+    else
+      isFirst = false;
+    writer.write("{\n\"type\": \"Wait\",\n\"stop_name\": ")
+        .writeQuoted(stopNames.getName(ride.from))
+        .write(",\n\"time\": ")
+        .writeNumber(routingSettings->busWaitTime)
+        .write("\n},\n");
+    writer.write("{\n\"type\": \"Bus\",\n\"bus\": ")
+        .writeQuoted(busNames.getName(ride.bus))
+        .write(",\n\"span_count\": ")
+        .writeNumber(ride.spanCount)
+        .write(",\n\"time\": ")
+        .writeNumber(ride.time)
+        .write("\n}");
+  }
+  writer.write("\n]\n}");
+}
+
+void BusManager::writeNearbyStops(ResponseWriter& writer,
+                                  double latitude,
+                                  double longitude,
+                                  optional<size_t> count,
+                                  optional<double> radius,
+                                  int requestId) const {
+  if (!finalized)
+    throw logic_error("Nearby stops require a finalized BusManager");
+  METRICS_TIMER(NEARBY_REQUEST);
+
+  // Reused by the queries of this thread
+  thread_local NearbyStops stops;
+  if (radius) {
+    stopIndex.findWithin(latitude, longitude, *radius, stops);
+    if (count && stops.size() > *count)
+      stops.resize(*count);
+  } else {
+    stopIndex.findNearest(latitude, longitude,
+                          count.value_or(stopIndex.size()), stops);
+  }
 
-  const set<string>& passingBuses = allStops.at(stopName).passingBuses;
+  writer.beginResponse().write("{\n\"request_id\": ").writeNumber(requestId);
+  writer.write(",\n\"stops\": [\n");
   bool isFirst = true;
-  for (const auto& bus : passingBuses) {
+  for (const auto& [stop, distance] : stops) {
     if (!isFirst)
-      info << ",\n";
+      writer.write(",\n");
     else
       isFirst = false;
-    info << '"' << bus << '"';
+    writer.write("{\n\"name\": ")
+        .writeQuoted(stopNames.getName(stop))
+        .write(",\n\"distance\": ")
+        .writeNumber(distance)
+        .write("\n}");
   }
-  info << "\n]\n}";
-  return info.str();
+  writer.write("\n]\n}");
 }
 
 void BusManager::addStop(const Stop& stop) {
-  allStops[stop.getName()].stop = stop;
+  // The stop gets its id before the stops it names
+  internStop(stop.getName());
+
+  vector<pair<StopId, double>> distances;
+  distances.reserve(stop.getDistances().size());
+  for (const auto& [name, distance] : stop.getDistances())
+    distances.emplace_back(internStop(name), distance);
+  addStop(stop.getName(), stop.getLat(), stop.getLon(), move(distances));
 }
 
-BusManager readBusManagerFromJson(const Json::Node& root) {
-  const auto& requests = root.AsMap().at("base_requests").AsArray();
+void BusManager::addStop(string_view name,
+                         double latitude,
+                         double longitude,
+                         vector<pair<StopId, double>> distances) {
+  METRICS_COUNT(BASE_STOPS);
+  finalized = false;
+  const StopId id = internStop(name);
+  roadDistances.declare(id, move(distances));
+
+  StopInfo& info = allStops[id];
+  info.isKnown = true;
+  info.hasPosition = true;
+  info.position = StopPosition::fromDegrees(latitude, longitude);
+  geometry.set(id, latitude, longitude);
+
+  // Both the position and the distances of a stop only matter to the routes
+  // through it
+  if (isPrepared) {
+    staleBuses.insert(end(staleBuses), begin(passingBuses[id]),
+                      end(passingBuses[id]));
+    stopIndex.update(id, info.position.getLatitude(),
+                     info.position.getLongitude());
+  }
+}
+
+BusStats BusManager::computeBusStats(const Bus& bus) const {
+  BusStats stats;
+  stats.stopCount = bus.getStopsNumber();
+  stats.uniqueStopCount = countUniqueStops(bus.getStops(), allStops.size());
+  stats.routeLength = calculateRouteDist(bus, [this](StopId from, StopId to) {
+    return roadDistances.get(from, to).value_or(0);
+  });
+  // Great-circle distances are symmetric, so the way back of a
+  // back-and-forth route is as long as the way there
+  const double straightLength =
+      geometry.measureRoute(bus.getStops()) * (bus.getIsCircle() ? 2 : 1);
+  stats.curvature = stats.routeLength / straightLength;
+  return stats;
+}
+
+void BusManager::sortBusesByName(vector<BusId>& busIds) const {
+  sort(begin(busIds), end(busIds), [this](BusId lhs, BusId rhs) {
+    return busNames.getName(lhs) < busNames.getName(rhs);
+  });
+  busIds.erase(unique(begin(busIds), end(busIds)), end(busIds));
+}
+
+void BusManager::freezePassingBuses() {
+  vector<BusId> byName(buses.size());
+  iota(begin(byName), end(byName), 0);
+  sortBusesByName(byName);
+  vector<uint32_t> nameRanks(buses.size());
+  for (uint32_t rank = 0; rank < byName.size(); ++rank)
+    nameRanks[byName[rank]] = rank;
+
+  for (auto& buses : passingBuses) {
+    sort(begin(buses), end(buses), [&nameRanks](BusId lhs, BusId rhs) {
+      return nameRanks[lhs] < nameRanks[rhs];
+    });
+    buses.erase(unique(begin(buses), end(buses)), end(buses));
+    buses.shrink_to_fit();
+  }
+}
+
+void BusManager::finalize() {
+  if (finalized)
+    return;
+  if (isPrepared) {
+    refreshStale();
+  } else {
+    roadDistances.build(allStops.size());
+    freezePassingBuses();
+    busStats.resize(buses.size());
+
+    const size_t taskCount =
+        min<size_t>(max(1u, thread::hardware_concurrency()),
+                    buses.size() / MIN_BUSES_PER_FINALIZE_TASK + 1);
+    const size_t chunk = (buses.size() + taskCount - 1) / taskCount;
+
+    vector<future<void>> tasks;
+    for (size_t first = 0; first < buses.size(); first += chunk) {
+      const size_t last = min(buses.size(), first + chunk);
+      tasks.push_back(async(launch::async, [this, first, last] {
+        for (size_t id = first; id < last; ++id)
+          busStats[id] = computeBusStats(buses[id]);
+      }));
+    }
+    for (auto& task : tasks)
+      task.get();
+
+    buildStopIndex();
+  }
+  if (routingSettings)
+    buildRouter();
+
+  finalized = true;
+  isPrepared = true;
+
+  METRICS_GAUGE(MODEL_BYTES, getMemoryUsage());
+  METRICS_GAUGE(NAME_POOL_BYTES, stopNames.getPool()->getMemoryUsage());
+  METRICS_GAUGE(STOPS, stopNames.size());
+  METRICS_GAUGE(BUSES, buses.size());
+}
+
+void BusManager::refreshStale() {
+  busStats.resize(buses.size());
+  sort(begin(staleBuses), end(staleBuses));
+  staleBuses.erase(unique(begin(staleBuses), end(staleBuses)),
+                   end(staleBuses));
+  for (const BusId id : staleBuses)
+    busStats[id] = computeBusStats(buses[id]);
+
+  sort(begin(staleStops), end(staleStops));
+  staleStops.erase(unique(begin(staleStops), end(staleStops)),
+                   end(staleStops));
+  for (const StopId stop : staleStops)
+    sortBusesByName(passingBuses[stop]);
+
+  staleBuses.clear();
+  staleStops.clear();
+}
+
+void BusManager::setRoutingSettings(RoutingSettings settings) {
+  finalized = false;
+  routingSettings = settings;
+}
+
+void BusManager::buildRouter() {
+  router = Router(allStops.size(), *routingSettings);
+
+  vector<StopId> run;
+  vector<double> segmentDistances;
+  for (BusId id = 0; id < buses.size(); ++id) {
+    run = buses[id].getStops();
+    for (const bool isBackward : {false, true}) {
+      if (isBackward && !buses[id].getIsCircle())
+        break;
+      if (isBackward)
+        reverse(begin(run), end(run));
+
+      segmentDistances.clear();
+      for (size_t i = 0; i + 1 < run.size(); ++i)
+        segmentDistances.push_back(
+            roadDistances.get(run[i], run[i + 1]).value_or(0));
+      router.addRun(id, run, segmentDistances);
+    }
+  }
+
+  router.build();
+}
+
+void BusManager::buildStopIndex() {
+  stopIndex = SpatialIndex();
+  for (StopId id = 0; id < allStops.size(); ++id)
+    if (const StopInfo& info = allStops[id]; info.hasPosition)
+      stopIndex.add(id, info.position.getLatitude(),
+                    info.position.getLongitude());
+  stopIndex.build();
+}
+
+optional<StopId> BusManager::findKnownStop(string_view stopName) const {
+  const auto stopId = stopNames.find(stopName);
+  if (!stopId || !allStops[*stopId].isKnown)
+    return nullopt;
+  return stopId;
+}
+
+BusStats BusManager::getBusStats(BusId busId) const {
+  if (finalized)
+    return busStats[busId];
+  return computeBusStats(buses.at(busId));
+}
+
+size_t BusManager::getMemoryUsage() const {
+  size_t bytes = stopNames.getMemoryUsage() + busNames.getMemoryUsage() +
+                 getHeapBytes(buses) + getHeapBytes(allStops) +
+                 getHeapBytes(passingBuses) + getHeapBytes(busStats) +
+                 geometry.getMemoryUsage() + roadDistances.getMemoryUsage() +
+                 router.getMemoryUsage() + stopIndex.getMemoryUsage();
+  for (const Bus& bus : buses)
+    bytes += getHeapBytes(bus.getStops()) + bus.getNumber().size();
+  for (const auto& stopBuses : passingBuses)
+    bytes += getHeapBytes(stopBuses);
+  return bytes;
+}
+
+size_t BusManager::estimateMemoryUsage(const Json::Node& root) {
+  size_t stopCount = 0;
+  size_t busCount = 0;
+  size_t idCount = 0;
+  if (const auto* requests = root.AsMap().find("base_requests"))
+    for (const auto& request : requests->AsArray()) {
+      const auto& requestMap = request.AsMap();
+      if (const auto* distances = requestMap.find("road_distances")) {
+        ++stopCount;
+        idCount += distances->AsMap().size();
+      } else if (const auto* stops = requestMap.find("stops")) {
+        ++busCount;
+        idCount += stops->AsArray().size();
+      }
+    }
+  // Geometry and a passing-bus list per stop, statistics per bus and an id
+  // per route stop and per road distance; indexes and the router come on top
+  return stopCount * (3 * sizeof(double) + sizeof(vector<BusId>)) +
+         busCount * (sizeof(Bus) + sizeof(BusStats)) +
+         idCount * sizeof(StopId);
+}
+
+void BusManager::save(SnapshotWriter& writer) const {
+  if (!finalized)
+    throw logic_error("Only a finalized BusManager can be saved");
+
+  stopNames.save(writer);
+  busNames.save(writer);
+
+  // Field by field, so that no padding bytes reach the file
+  vector<uint8_t> stopFlags;
+  vector<StopPosition> positions;
+  for (const StopInfo& info : allStops) {
+    stopFlags.push_back(
+        static_cast<uint8_t>(info.isKnown | info.hasPosition << 1));
+    positions.push_back(info.position);
+  }
+  writer.writeArray(stopFlags);
+  writer.writeArray(positions);
+  geometry.save(writer);
+
+  vector<uint64_t> passingEnds;
+  vector<BusId> allPassingBuses;
+  for (const auto& buses : passingBuses) {
+    allPassingBuses.insert(end(allPassingBuses), begin(buses), end(buses));
+    passingEnds.push_back(allPassingBuses.size());
+  }
+  writer.writeArray(passingEnds);
+  writer.writeArray(allPassingBuses);
+
+  vector<uint8_t> isCircle;
+  vector<uint64_t> routeEnds;
+  vector<StopId> routes;
+  for (const Bus& bus : buses) {
+    isCircle.push_back(bus.getIsCircle());
+    routes.insert(end(routes), begin(bus.getStops()), end(bus.getStops()));
+    routeEnds.push_back(routes.size());
+  }
+  writer.writeArray(isCircle);
+  writer.writeArray(routeEnds);
+  writer.writeArray(routes);
+
+  roadDistances.save(writer);
+  vector<uint64_t> stopCounts;
+  vector<int32_t> uniqueStopCounts;
+  vector<double> routeLengths;
+  vector<double> curvatures;
+  for (const BusStats& stats : busStats) {
+    stopCounts.push_back(stats.stopCount);
+    uniqueStopCounts.push_back(stats.uniqueStopCount);
+    routeLengths.push_back(stats.routeLength);
+    curvatures.push_back(stats.curvature);
+  }
+  writer.writeArray(stopCounts);
+  writer.writeArray(uniqueStopCounts);
+  writer.writeArray(routeLengths);
+  writer.writeArray(curvatures);
+
+  writer.writeValue(routingSettings.has_value());
+  if (routingSettings)
+    router.save(writer);
+}
+
+BusManager BusManager::load(SnapshotReader& reader) {
   BusManager manager;
+  manager.stopNames.load(reader);
+  manager.busNames.load(reader);
 
-  for (const auto& request : requests) {
-    const auto& requestMap = request.AsMap();
-    const string type = requestMap.at("type").AsString();
-    if (type == "Bus")
-      manager.addBus(toBus(requestMap));
-    else if (type == "Stop")
-      manager.addStop(toStop(requestMap));
-    else
-      throw std::runtime_error("Invalid requst type");
+  const auto stopFlags = reader.readArray<uint8_t>();
+  const auto positions = reader.readArray<StopPosition>();
+  const size_t stopCount = manager.stopNames.size();
+  const size_t busCount = manager.busNames.size();
+  checkSnapshot(stopFlags.size() == stopCount &&
+                positions.size() == stopCount);
+  manager.allStops.resize(stopFlags.size());
+  for (StopId id = 0; id < stopFlags.size(); ++id) {
+    StopInfo& info = manager.allStops[id];
+    info.isKnown = stopFlags[id] & 1;
+    info.hasPosition = stopFlags[id] & 2;
+    info.position = positions[id];
+  }
+  manager.geometry.load(reader, stopCount);
+
+  const auto passingEnds = reader.readArray<uint64_t>();
+  const auto allPassingBuses = reader.readArray<BusId>();
+  checkSnapshot(passingEnds.size() == stopCount);
+  checkSnapshotEnds(passingEnds, allPassingBuses.size());
+  checkSnapshotIds(allPassingBuses, busCount);
+  manager.passingBuses.resize(passingEnds.size());
+  uint64_t first = 0;
+  for (StopId id = 0; id < passingEnds.size(); ++id) {
+    manager.passingBuses[id].assign(begin(allPassingBuses) + first,
+                                    begin(allPassingBuses) + passingEnds[id]);
+    first = passingEnds[id];
+  }
+
+  const auto isCircle = reader.readArray<uint8_t>();
+  const auto routeEnds = reader.readArray<uint64_t>();
+  const auto routes = reader.readArray<StopId>();
+  checkSnapshot(isCircle.size() == busCount && routeEnds.size() == busCount);
+  checkSnapshotEnds(routeEnds, routes.size());
+  checkSnapshotIds(routes, stopCount);
+  manager.buses.resize(isCircle.size());
+  first = 0;
+  for (BusId id = 0; id < isCircle.size(); ++id) {
+    Bus& bus = manager.buses[id];
+    bus.setNumber(string(manager.busNames.getName(id)))
+        .setIsCircle(isCircle[id]);
+    for (uint64_t i = first; i < routeEnds[id]; ++i)
+      bus.addStop(routes[i]);
+    first = routeEnds[id];
   }
+
+  manager.roadDistances.load(reader, stopCount);
+  const auto stopCounts = reader.readArray<uint64_t>();
+  const auto uniqueStopCounts = reader.readArray<int32_t>();
+  const auto routeLengths = reader.readArray<double>();
+  const auto curvatures = reader.readArray<double>();
+  checkSnapshot(stopCounts.size() == busCount &&
+                uniqueStopCounts.size() == busCount &&
+                routeLengths.size() == busCount &&
+                curvatures.size() == busCount);
+  manager.busStats.resize(stopCounts.size());
+  for (BusId id = 0; id < stopCounts.size(); ++id)
+    manager.busStats[id] = {stopCounts[id], uniqueStopCounts[id],
+                            routeLengths[id], curvatures[id]};
+
+  if (reader.readValue<bool>()) {
+    manager.router.load(reader, stopCount, busCount);
+    manager.routingSettings = manager.router.getSettings();
+  }
+  manager.buildStopIndex();
+
+  manager.finalized = true;
+  manager.isPrepared = true;
   return manager;
 }
 
-vector<string> processRequestsFromJson(const BusManager& manager,
-                                       const Json::Node& root) {
-  const auto& requests = root.AsMap().at("stat_requests").AsArray();
-  vector<string> res;
+BusManager readBusManagerFromJson(const Json::Node& root) {
+  return readBusManagerFromJson(root, make_shared<NamePool>());
+}
+
+BusManager readBusManagerFromJson(const Json::Node& root,
+                                  shared_ptr<NamePool> names) {
+  METRICS_TIMER(BUILD);
+  const auto& requests = root.AsMap().at("base_requests").AsArray();
+  BusManager manager(move(names));
+
+  for (const auto& request : requests)
+    addBaseRequest(request.AsMap(), manager);
+
+  if (const auto* settings = root.AsMap().find("routing_settings"))
+    manager.setRoutingSettings(toRoutingSettings(settings->AsMap()));
+
+  manager.finalize();
+  return manager;
+}
+
+void processRequest(const BusManager& manager,
+                    const Json::Node& request,
+                    ResponseWriter& writer) {
+  const auto& requestMap = request.AsMap();
+  const string_view type = requestMap.at("type").AsString();
+  const int id = requestMap.at("id").AsInt();
+  if (type == "Bus")
+    manager.writeBusInfo(writer, requestMap.at("name").AsString(), id);
+  else if (type == "Stop")
+    manager.writeStopInfo(writer, requestMap.at("name").AsString(), id);
+  else if (type == "Route")
+    manager.writeRouteInfo(writer, requestMap.at("from").AsString(),
+                           requestMap.at("to").AsString(), id);
+  else if (type == "Nearby")
+    manager.writeNearbyStops(writer, requestMap.at("latitude").AsDouble(),
+                             requestMap.at("longitude").AsDouble(),
+                             toNearbyCount(requestMap.find("count")),
+                             toNearbyRadius(requestMap.find("radius")), id);
+  else
+    METRICS_COUNT(UNKNOWN_TYPE);
+}
 
-  for (const auto& request : requests) {
-    const auto& requestMap = request.AsMap();
-    const string type = requestMap.at("type").AsString();
-    const string name = requestMap.at("name").AsString();
-    const int id = requestMap.at("id").AsInt();
-    if (type == "Bus")
-      res.push_back(manager.getBusInfo(name, id));
-    else if (type == "Stop")
-      res.push_back(manager.getStopInfo(name, id));
+void processRequestsFromJson(const BusManager& manager,
+                             const Json::Node& root,
+                             ResponseWriter& writer,
+                             size_t threadCount) {
+  const auto& requests = root.AsMap().at("stat_requests").AsArray();
+  const size_t blockCount =
+      (requests.size() + STAT_REQUESTS_BLOCK - 1) / STAT_REQUESTS_BLOCK;
+  threadCount = min(threadCount, blockCount);
+  if (threadCount <= 1) {
+    for (const auto& request : requests)
+      processRequest(manager, request, writer);
+    return;
   }
 
-  return res;
+  // Workers grab blocks of requests and serialize each block into its own
+  // buffer; the buffers are then spliced in order.
+  vector<ResponseWriter> blocks(blockCount);
+  atomic<size_t> nextBlock = 0;
+  auto worker = [&] {
+    for (size_t block = nextBlock++; block < blockCount; block = nextBlock++) {
+      const size_t first = block * STAT_REQUESTS_BLOCK;
+      const size_t last = min(requests.size(), first + STAT_REQUESTS_BLOCK);
+      for (size_t i = first; i < last; ++i)
+        processRequest(manager, requests[i], blocks[block]);
+    }
+  };
+
+  vector<future<void>> workers;
+  for (size_t i = 1; i < threadCount; ++i)
+    workers.push_back(async(launch::async, worker));
+  worker();
+  for (auto& w : workers)
+    w.get();
+
+  for (const auto& block : blocks)
+    writer.appendResponses(block);
 }
 
-vector<string> processJson(istream& input) {
-  const auto root = Json::Load(input).GetRoot();
-  BusManager manager = readBusManagerFromJson(root);
-  return processRequestsFromJson(manager, root);
+void processJson(istream& input, ostream& output, size_t threadCount) {
+  const auto document = [&input] {
+    METRICS_TIMER(PARSE);
+    return Json::Load(input);
+  }();
+  const auto& root = document.GetRoot();
+
+  ResponseWriter writer(&output);
+  writer.write("[\n");
+  if (root.AsMap().count("feeds")) {
+    processFeedsJson(root, writer);
+  } else {
+    const BusManager manager = readBusManagerFromJson(root);
+    processRequestsFromJson(manager, root, writer, threadCount);
+  }
+  writer.write("\n]\n").flush();
+  output.flush();
 }
 
-void PrintResponses(const vector<string>& responses, ostream& stream) {
-  stream << "[" << endl;
-  bool isFirst = true;
-  for (const string& response : responses) {
-    if (!isFirst)
-      stream << ",\n";
+namespace {
+
+// Feeds base requests into a BusManager while the document is being read and
+// answers stat requests as soon as all base requests have been seen. Stat
+// requests that precede base_requests wait until the end of the document;
+// routing_settings must come before the stat requests that need them.
+class StreamingRequestHandler : public Json::Handler {
+ public:
+  explicit StreamingRequestHandler(ResponseWriter& writer) : writer(writer) {}
+
+  void StartObject() override { ++depth; }
+
+  void StartArray() override { ++depth; }
+
+  void Key(string_view key) override {
+    if (depth == ROOT_DEPTH)
+      section = key;
+    else if (depth == SECTION_DEPTH || depth == REQUEST_DEPTH)
+      field = key;
+    else if (depth == REQUEST_DEPTH + 1)
+      distanceTo = key;
+  }
+
+  void String(string_view value) override {
+    if (depth == REQUEST_DEPTH && field == "type")
+      request.type = value;
+    else if (depth == REQUEST_DEPTH && field == "name")
+      request.name = value;
+    else if (depth == REQUEST_DEPTH && field == "from")
+      request.from = value;
+    else if (depth == REQUEST_DEPTH && field == "to")
+      request.to = value;
+    else if (depth == REQUEST_DEPTH + 1 && field == "stops")
+      request.stops.emplace_back(value);
+  }
+
+  void Number(double value) override {
+    if (depth == SECTION_DEPTH && section == "routing_settings")
+      setRoutingSetting(value);
+    else if (depth == REQUEST_DEPTH && field == "latitude")
+      request.latitude = value;
+    else if (depth == REQUEST_DEPTH && field == "longitude")
+      request.longitude = value;
+    else if (depth == REQUEST_DEPTH && field == "id")
+      request.id = static_cast<int>(value);
+    else if (depth == REQUEST_DEPTH && field == "count")
+      request.count = max(static_cast<int>(value), 0);
+    else if (depth == REQUEST_DEPTH && field == "radius")
+      request.radius = value;
+    else if (depth == REQUEST_DEPTH + 1 && field == "road_distances")
+      request.distances.emplace_back(distanceTo, static_cast<int>(value));
+  }
+
+  void Bool(bool value) override {
+    if (depth == REQUEST_DEPTH && field == "is_roundtrip")
+      request.isRoundtrip = value;
+  }
+
+  void EndObject() override {
+    if (depth == REQUEST_DEPTH) {
+      if (section == "base_requests")
+        addBaseRequest();
+      else if (section == "stat_requests")
+        addStatRequest();
+      request.clear();
+    }
+    --depth;
+  }
+
+  void EndArray() override {
+    if (depth == SECTION_DEPTH && section == "base_requests")
+      isBaseComplete = true;
+    --depth;
+  }
+
+  void finish() {
+    isBaseComplete = true;
+    for (const auto& pending : pendingRequests)
+      answer(pending);
+    pendingRequests.clear();
+  }
+
+ private:
+  static const int ROOT_DEPTH = 1;
+  static const int SECTION_DEPTH = 2;
+  static const int REQUEST_DEPTH = 3;
+
+  struct Request {
+    string type;
+    string name;
+    string from;
+    string to;
+    int id = 0;
+    double latitude = 0;
+    double longitude = 0;
+    bool isRoundtrip = false;
+    optional<size_t> count;
+    optional<double> radius;
+    vector<pair<string, double>> distances;
+    vector<string> stops;
+
+    // Keeps the capacity of the strings, so that stat requests with names
+    // seen before need no allocation
+    void clear() {
+      type.clear();
+      name.clear();
+      from.clear();
+      to.clear();
+      id = 0;
+      latitude = longitude = 0;
+      isRoundtrip = false;
+      count.reset();
+      radius.reset();
+      distances.clear();
+      stops.clear();
+    }
+  };
+
+  ResponseWriter& writer;
+  BusManager manager;
+  bool isFinalized = false;
+  bool isBaseComplete = false;
+
+  int depth = 0;
+  string section;
+  string field;
+  string distanceTo;
+  Request request;
+  vector<Request> pendingRequests;
+  RoutingSettings routingSettings;
+
+  void addBaseRequest() {
+    if (request.type == "Bus") {
+      Bus bus;
+      bus.setNumber(request.name).setIsCircle(!request.isRoundtrip);
+      for (const auto& stop : request.stops)
+        bus.addStop(manager.internStop(stop));
+      manager.addBus(bus);
+    } else if (request.type == "Stop") {
+      manager.internStop(request.name);
+      vector<pair<StopId, double>> distances;
+      distances.reserve(request.distances.size());
+      for (const auto& [name, distance] : request.distances)
+        distances.emplace_back(manager.internStop(name), distance);
+      manager.addStop(request.name, request.latitude, request.longitude,
+                      move(distances));
+    } else {
+      throw std::runtime_error("Invalid requst type");
+    }
+    isFinalized = false;
+  }
+
+  void setRoutingSetting(double value) {
+    if (field == "bus_wait_time")
+      routingSettings.busWaitTime = value;
+    else if (field == "bus_velocity")
+      routingSettings.busVelocity = value;
+    manager.setRoutingSettings(routingSettings);
+    isFinalized = false;
+  }
+
+  void addStatRequest() {
+    if (isBaseComplete)
+      answer(request);
     else
-      isFirst = false;
-    stream << response;
+      pendingRequests.push_back(move(request));
+  }
+
+  void answer(const Request& statRequest) {
+    if (!isFinalized) {
+      manager.finalize();
+      isFinalized = true;
+    }
+
+    if (statRequest.type == "Bus")
+      manager.writeBusInfo(writer, statRequest.name, statRequest.id);
+    else if (statRequest.type == "Stop")
+      manager.writeStopInfo(writer, statRequest.name, statRequest.id);
+    else if (statRequest.type == "Route")
+      manager.writeRouteInfo(writer, statRequest.from, statRequest.to,
+                             statRequest.id);
+    else if (statRequest.type == "Nearby")
+      manager.writeNearbyStops(writer, statRequest.latitude,
+                               statRequest.longitude, statRequest.count,
+                               statRequest.radius, statRequest.id);
+  }
+};
+
+}  // namespace
+
+void processJsonStream(istream& input, ostream& output) {
+  ResponseWriter writer(&output);
+  writer.write("[\n");
+  StreamingRequestHandler handler(writer);
+  Json::ReadEvents(input, handler);
+  handler.finish();
+  writer.write("\n]\n").flush();
+  output.flush();
+}
+
+void serveJsonLines(istream& input, ostream& output) {
+  VersionedBusManager versions{BusManager()};
+  auto writeError = [&output](string_view message) {
+    ResponseWriter writer(&output);
+    writer.write("{\"error_message\": ").writeQuoted(message).write("}\n");
+  };
+
+  // Base requests and settings wait for the next line that writes anything,
+  // so that a run of them costs a single copy of the model
+  vector<Json::Document> pending;
+  auto publish = [&] {
+    if (pending.empty())
+      return;
+    vector<string> errors;
+    versions.update([&pending, &errors](BusManager& manager) {
+      for (const auto& document : pending) {
+        try {
+          const auto& requestMap = document.GetRoot().AsMap();
+          if (const auto* settings = requestMap.find("routing_settings"))
+            manager.setRoutingSettings(toRoutingSettings(settings->AsMap()));
+          else
+            addBaseRequest(requestMap, manager);
+        } catch (const exception& e) {
+          errors.push_back(e.what());
+        }
+      }
+    });
+    pending.clear();
+    for (const string& error : errors)
+      writeError(error);
+  };
+
+  string line;
+  ostringstream response;
+  while (getline(input, line)) {
+    if (trim(line, " \t\r").empty())
+      continue;
+
+    try {
+      auto document = Json::Load(vector<char>(begin(line), end(line)));
+      if (!document.GetRoot().AsMap().count("id")) {
+        pending.push_back(move(document));
+        continue;
+      }
+      publish();
+      response.str("");
+      {
+        ResponseWriter writer(&response);
+        processRequest(*versions.read(), document.GetRoot(), writer);
+      }
+      // One response per line: fold the layout line breaks into spaces
+      string text = response.str();
+      replace(begin(text), end(text), '\n', ' ');
+      output << text << '\n';
+    } catch (const exception& e) {
+      publish();
+      writeError(e.what());
+    }
+    output.flush();
   }
-  stream << "\n]" << endl;
+  publish();
+  output.flush();
+}
+
+void makeBase(istream& input, const string& snapshotPath) {
+  const auto document = Json::Load(input);
+  const BusManager manager = readBusManagerFromJson(document.GetRoot());
+
+  ofstream output(snapshotPath, ios::binary);
+  SnapshotWriter writer(output);
+  manager.save(writer);
 }
 
-int main() {
-  // TransportTests::RunTests();
-  const auto respones = processJson();
-  PrintResponses(respones);
-  return 0;
-}
\ No newline at end of file
+void processRequests(const string& snapshotPath,
+                     istream& input,
+                     ostream& output,
+                     size_t threadCount) {
+  const BusManager manager = [&snapshotPath] {
+    SnapshotReader reader(snapshotPath);
+    return BusManager::load(reader);
+  }();
+  const auto document = Json::Load(input);
+
+  ResponseWriter writer(&output);
+  writer.write("[\n");
+  processRequestsFromJson(manager, document.GetRoot(), writer, threadCount);
+  writer.write("\n]\n").flush();
+  output.flush();
+}
@@ -1,11 +1,21 @@
 #pragma once
 
+#include "geo.h"
+#include "ids.h"
+#include "interner.h"
+#include "json.h"
+#include "response_writer.h"
+#include "road_distances.h"
+#include "router.h"
+#include "snapshot.h"
+#include "spatial_index.h"
+
 #include <iostream>
+#include <memory>
 #include <optional>
-#include <set>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 class Stop {
@@ -13,71 +23,206 @@ class Stop {
   Stop() {}
   Stop(std::string name, double lat, double lon);
 
-  std::string getName() const;
+  const std::string& getName() const;
   double getLat() const;
   double getLon() const;
 
-  std::optional<double> getDistance(const std::string& stopName) const;
+  const std::vector<std::pair<std::string, double>>& getDistances() const;
 
   void addDistance(const std::string& otherStopName, double distance);
 
  private:
   std::string name_;
-  double lat_;
-  double lon_;
-  std::unordered_map<std::string, double> distanceToOtherStops;
+  double lat_ = 0;
+  double lon_ = 0;
+  std::vector<std::pair<std::string, double>> distanceToOtherStops;
 };
 
 class Bus {
  public:
   Bus();
 
-  void addStop(const std::string& stop);
+  void addStop(StopId stop);
 
   Bus& setNumber(std::string number);
 
   Bus& setIsCircle(bool isCircle);
 
-  double getUniqueStopsNumber() const;
-
   size_t getStopsNumber() const;
 
   bool getIsCircle() const;
 
-  std::string getNumber() const;
+  const std::string& getNumber() const;
 
-  const std::vector<std::string>& getStops() const;
+  const std::vector<StopId>& getStops() const;
 
  private:
   bool isCircle_;
   std::string number_;
-  int uniqueStops;
-  std::vector<std::string> stops_;
+  std::vector<StopId> stops_;
 };
 
+// What every stop lookup touches. Names live in the interner, exact
+// trigonometry in StopGeometry and passing buses in their own lists.
 struct StopInfo {
-  Stop stop;
-  std::set<std::string> passingBuses;
+  bool isKnown = false;
+  // Declared by a Stop request rather than only named by a bus
+  bool hasPosition = false;
+  StopPosition position;
 };
 
-using SoptsInfo = std::unordered_map<std::string, StopInfo>;
+using SoptsInfo = std::vector<StopInfo>;
+
+struct BusStats {
+  size_t stopCount = 0;
+  int uniqueStopCount = 0;
+  double routeLength = 0;
+  double curvature = 0;
+};
 
 class BusManager {
  public:
+  BusManager();
+  // Stop and bus names go to `names`, which other managers may share.
+  explicit BusManager(std::shared_ptr<NamePool> names);
+
+  StopId internStop(std::string_view stopName);
+
   void addBus(const Bus& bus);
 
-  std::string getBusInfo(const std::string& busNumber, int requestId) const;
+  void setRoutingSettings(RoutingSettings settings);
+
+  // Precomputes per-bus statistics and, given routing settings, the routing
+  // graph once base data is complete. Any later addBus/addStop drops the cache
+  // until finalize is called again; that call then recomputes only the
+  // statistics and passing-bus lists the changes touched, while the routing
+  // graph is rebuilt whole.
+  void finalize();
+
+  BusStats getBusStats(BusId busId) const;
+
+  // Heap bytes of the model, not counting the name pool.
+  size_t getMemoryUsage() const;
+
+  // A lower bound of getMemoryUsage for the model the base_requests of root
+  // would build, counted without building it.
+  static size_t estimateMemoryUsage(const Json::Node& root);
+
+  void writeBusInfo(ResponseWriter& writer,
+                    std::string_view busNumber,
+                    int requestId) const;
+
+  void writeStopInfo(ResponseWriter& writer,
+                     std::string_view stopName,
+                     int requestId) const;
 
-  std::string getStopInfo(const std::string& stopName, int requestId) const;
+  // Requires a finalized manager.
+  void writeRouteInfo(ResponseWriter& writer,
+                      std::string_view fromStop,
+                      std::string_view toStop,
+                      int requestId) const;
+
+  // Stops around a point, closest first: the `count` nearest ones, those
+  // within `radius` meters, or the nearest ones within the radius when both
+  // are given. Requires a finalized manager.
+  void writeNearbyStops(ResponseWriter& writer,
+                        double latitude,
+                        double longitude,
+                        std::optional<size_t> count,
+                        std::optional<double> radius,
+                        int requestId) const;
 
   void addStop(const Stop& stop);
 
+  // The same with road distances keyed by interned ids, so loaders can pass
+  // names straight from their input without copying them into a Stop.
+  void addStop(std::string_view name,
+               double latitude,
+               double longitude,
+               std::vector<std::pair<StopId, double>> distances);
+
+  // Writes a finalized manager; loading restores it finalized, without
+  // recomputing statistics or the routing graph.
+  void save(SnapshotWriter& writer) const;
+  static BusManager load(SnapshotReader& reader);
+
  private:
-  std::unordered_map<std::string, Bus> buses;
+  StringInterner stopNames;
+  StringInterner busNames;
+  std::vector<Bus> buses;
   SoptsInfo allStops;
-};
+  // Appended while loading; sorted by bus name and deduplicated on finalize
+  std::vector<std::vector<BusId>> passingBuses;
+  StopGeometry geometry;
+  RoadDistances roadDistances;
+  std::vector<BusStats> busStats;
+  std::optional<RoutingSettings> routingSettings;
+  Router router;
+  SpatialIndex stopIndex;
+  bool finalized = false;
+  // Set by the first finalize; from then on changes record what they make
+  // stale instead of dropping every cache.
+  bool isPrepared = false;
+  std::vector<BusId> staleBuses;
+  std::vector<StopId> staleStops;
+
+  BusStats computeBusStats(const Bus& bus) const;
+
+  void buildRouter();
 
-void PrintResponses(const std::vector<std::string>& responses,
-                    std::ostream& stream = std::cout);
+  void buildStopIndex();
+
+  void sortBusesByName(std::vector<BusId>& busIds) const;
+
+  void freezePassingBuses();
+
+  void refreshStale();
+
+  std::optional<StopId> findKnownStop(std::string_view stopName) const;
+};
 
-std::vector<std::string> processJson(std::istream& input = std::cin);
\ No newline at end of file
+BusManager readBusManagerFromJson(const Json::Node& root);
+
+BusManager readBusManagerFromJson(const Json::Node& root,
+                                  std::shared_ptr<NamePool> names);
+
+void processRequest(const BusManager& manager,
+                    const Json::Node& request,
+                    ResponseWriter& writer);
+
+void processRequestsFromJson(const BusManager& manager,
+                             const Json::Node& root,
+                             ResponseWriter& writer,
+                             size_t threadCount = 1);
+
+// Stat requests are answered by up to threadCount threads; the order of the
+// responses always matches the order of the requests. A document with
+// "feeds" is handed to processFeedsJson.
+void processJson(std::istream& input = std::cin,
+                 std::ostream& output = std::cout,
+                 size_t threadCount = 1);
+
+// Two-phase mode: makeBase turns base_requests (and routing_settings) into a
+// snapshot file, processRequests answers stat_requests against it.
+void makeBase(std::istream& input, const std::string& snapshotPath);
+
+void processRequests(const std::string& snapshotPath,
+                     std::istream& input = std::cin,
+                     std::ostream& output = std::cout,
+                     size_t threadCount = 1);
+
+// Long-running mode: every input line is a JSON object, either a base request
+// ({"type": "Stop"|"Bus", ...}), a {"routing_settings": {...}} update or a
+// stat request (anything with an "id"). Each stat request is answered on a
+// single output line as soon as it is read. Base requests are published as a
+// new VersionedBusManager version when the next line is answered. Every
+// version is a full copy of the model, finalized again with the router
+// rebuilt, so each published batch costs about as much as loading the whole
+// feed; batch base requests rather than interleaving them with queries.
+void serveJsonLines(std::istream& input = std::cin,
+                    std::ostream& output = std::cout);
+
+// Reads the document as a stream of events instead of loading it whole, so
+// peak memory follows the size of the model rather than of the input.
+void processJsonStream(std::istream& input = std::cin,
+                       std::ostream& output = std::cout);
@@ -0,0 +1,124 @@
+#include "versioned_manager.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+// Hands every thread that reads a VersionedBusManager its own slot index;
+// indices of finished threads are reused.
+class ReaderIndex {
+ public:
+  ReaderIndex() {
+    lock_guard lock(indicesMutex());
+    auto& free = freeIndices();
+    if (!free.empty()) {
+      index = free.back();
+      free.pop_back();
+    } else {
+      index = nextIndex()++;
+    }
+  }
+
+  ~ReaderIndex() {
+    lock_guard lock(indicesMutex());
+    freeIndices().push_back(index);
+  }
+
+  size_t get() const {
+    if (index >= VersionedBusManager::MAX_READER_THREADS)
+      throw runtime_error("Too many threads read a VersionedBusManager");
+    return index;
+  }
+
+ private:
+  size_t index;
+
+  static mutex& indicesMutex() {
+    static mutex instance;
+    return instance;
+  }
+
+  static vector<size_t>& freeIndices() {
+    static vector<size_t> instance;
+    return instance;
+  }
+
+  static size_t& nextIndex() {
+    static size_t instance = 0;
+    return instance;
+  }
+};
+
+size_t getReaderIndex() {
+  thread_local const ReaderIndex index;
+  return index.get();
+}
+
+}  // namespace
+
+VersionedBusManager::ReadGuard::ReadGuard(atomic<uint64_t>* slot,
+                                          const BusManager* manager)
+    : slot(slot), manager(manager) {}
+
+VersionedBusManager::ReadGuard::~ReadGuard() {
+  if (slot)
+    slot->store(0);
+}
+
+VersionedBusManager::VersionedBusManager(BusManager initial) {
+  initial.finalize();
+  current = new BusManager(move(initial));
+}
+
+VersionedBusManager::~VersionedBusManager() {
+  delete current.load();
+}
+
+VersionedBusManager::ReadGuard VersionedBusManager::read() const {
+  atomic<uint64_t>& slot = readers[getReaderIndex()].epoch;
+  if (slot.load(memory_order_relaxed) != 0)
+    return ReadGuard(nullptr, current.load());
+
+  // A version replaced before the announcement cannot be loaded after it
+  slot.store(epoch.load());
+  return ReadGuard(&slot, current.load());
+}
+
+void VersionedBusManager::update(const function<void(BusManager&)>& change) {
+  lock_guard lock(writerMutex);
+  auto next = make_unique<BusManager>(*current.load());
+  change(*next);
+  next->finalize();
+
+  const BusManager* previous = current.exchange(next.release());
+  retired.emplace_back(epoch.fetch_add(1), previous);
+  retiredCount = retired.size();
+  reclaim();
+}
+
+size_t VersionedBusManager::getRetiredCount() const {
+  return retiredCount;
+}
+
+void VersionedBusManager::collectRetired() {
+  lock_guard lock(writerMutex);
+  reclaim();
+}
+
+void VersionedBusManager::reclaim() {
+  uint64_t oldestReader = numeric_limits<uint64_t>::max();
+  for (const ReaderSlot& reader : readers)
+    if (const uint64_t readerEpoch = reader.epoch.load(); readerEpoch != 0)
+      oldestReader = min(oldestReader, readerEpoch);
+
+  retired.erase(remove_if(begin(retired), end(retired),
+                          [oldestReader](const auto& version) {
+                            return version.first < oldestReader;
+                          }),
+                end(retired));
+  retiredCount = retired.size();
+}
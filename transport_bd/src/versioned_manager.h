@@ -0,0 +1,78 @@
+#pragma once
+
+#include "transport.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Publishes immutable, finalized versions of a BusManager. Readers pin the
+// latest version without taking locks: each reader thread announces the epoch
+// it entered in its own slot, and a replaced version is freed once no reader
+// announced an epoch old enough to still see it. Only writers free versions,
+// so a reader never pays for destroying one; writers are serialized.
+class VersionedBusManager {
+ public:
+  static const size_t MAX_READER_THREADS = 256;
+
+  class ReadGuard {
+   public:
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+    ~ReadGuard();
+
+    const BusManager& operator*() const { return *manager; }
+    const BusManager* operator->() const { return manager; }
+
+   private:
+    friend class VersionedBusManager;
+
+    ReadGuard(std::atomic<uint64_t>* slot, const BusManager* manager);
+
+    // Null for a guard nested in another one of the same thread
+    std::atomic<uint64_t>* slot;
+    const BusManager* manager;
+  };
+
+  explicit VersionedBusManager(BusManager initial);
+  VersionedBusManager(const VersionedBusManager&) = delete;
+  VersionedBusManager& operator=(const VersionedBusManager&) = delete;
+  // No reader may outlive the manager.
+  ~VersionedBusManager();
+
+  ReadGuard read() const;
+
+  // Applies `change` to a copy of the latest version, finalizes the copy and
+  // publishes it. Readers that already hold the previous version keep it.
+  void update(const std::function<void(BusManager&)>& change);
+
+  // Replaced versions still waiting for their readers.
+  size_t getRetiredCount() const;
+
+  // Frees the replaced versions no reader holds any more. update() does it
+  // as well, so versions released after the last update wait for this call
+  // or the next update.
+  void collectRetired();
+
+ private:
+  struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch = 0;
+  };
+
+  std::atomic<const BusManager*> current;
+  std::atomic<uint64_t> epoch = 1;
+  mutable std::array<ReaderSlot, MAX_READER_THREADS> readers;
+
+  std::mutex writerMutex;
+  // Versions tagged with the last epoch in which they were current
+  std::vector<std::pair<uint64_t, std::unique_ptr<const BusManager>>> retired;
+  std::atomic<size_t> retiredCount = 0;
+
+  // Requires writerMutex.
+  void reclaim();
+};
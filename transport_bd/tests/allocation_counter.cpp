@@ -0,0 +1,135 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace {
+atomic<size_t> allocationCount = 0;
+
+void* allocate(size_t size) {
+  ++allocationCount;
+  if (void* memory = malloc(size ? size : 1))
+    return memory;
+  throw bad_alloc();
+}
+
+// aligned_alloc wants a size that is a multiple of the alignment
+void* allocate(size_t size, align_val_t alignment) {
+  ++allocationCount;
+  const size_t step = static_cast<size_t>(alignment);
+  const size_t alignedSize = (size + step - 1) / step * step;
+  if (void* memory = aligned_alloc(step, alignedSize ? alignedSize : step))
+    return memory;
+  throw bad_alloc();
+}
+}  // namespace
+
+size_t getAllocationCount() {
+  return allocationCount;
+}
+
+// Every replaceable form is replaced, so whatever a form allocates is freed
+// by the matching replaced delete rather than by the standard one
+
+void* operator new(size_t size) {
+  return allocate(size);
+}
+
+void* operator new[](size_t size) {
+  return allocate(size);
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+  return allocate(size, alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+  return allocate(size, alignment);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (const bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+  try {
+    return allocate(size);
+  } catch (const bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new(size_t size,
+                   align_val_t alignment,
+                   const nothrow_t&) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (const bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t size,
+                     align_val_t alignment,
+                     const nothrow_t&) noexcept {
+  try {
+    return allocate(size, alignment);
+  } catch (const bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, size_t, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, const nothrow_t&) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, const nothrow_t&) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, align_val_t, const nothrow_t&) noexcept {
+  free(memory);
+}
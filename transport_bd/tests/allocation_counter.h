@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+
+// Heap allocations made through any form of operator new or new[] so far by
+// any thread. The counting operators live in allocation_counter.cpp, which
+// only the test executable links, so the shipped binaries keep the standard
+// allocator.
+size_t getAllocationCount();
@@ -0,0 +1,6 @@
+#include "../src/tests.h"
+
+int main() {
+  TransportTests::RunTests();
+  return 0;
+}